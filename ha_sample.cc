@@ -24,31 +24,128 @@
 #include <mysql/plugin.h>
 #include "ha_sample.h"
 #include "sql_class.h"
+#include "sql_show.h"
 #include <pthread.h>
 #include <zlib.h>
 #include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Rows are bump-allocated from slabs of this size; larger rows get their own slab
+#define SAMPLE_SLAB_SIZE (64*1024)
+// Drained slabs kept per table for reuse instead of going back to my_free
+#define SAMPLE_SLAB_SPARES 16
+// Longer values are always stored inline and never looked up
+#define SAMPLE_DICTIONARY_VALUE 256
+// Value bytes a column dictionary holds before new values are stored inline
+#define SAMPLE_DICTIONARY_BYTES (16*1024)
+// Time buckets a SAMPLE_WINDOW is divided into; expiry is per bucket
+#define SAMPLE_WINDOW_BUCKETS 16
+// Quantile sketch bucket ratio: values are placed within 1% of their bucket
+#define SAMPLE_SKETCH_GAMMA 1.02
+// Rows an owner stores before adding them to the global gauges
+#define SAMPLE_SETTLE 64
+// Seconds between background writes of SAMPLE_DURABLE tables
+#define SAMPLE_FLUSH_INTERVAL 1
+// Start of every record in a .sample file
+#define SAMPLE_FILE_MAGIC 0x504d4153 // "SAMP"
+// Hash of a NULL SAMPLE_HASH or SAMPLE_KEY value, apart from the 0 that
+// an integer 0 hashes to
+#define SAMPLE_HASH_NULL 0x2545F4914F6CDD1DULL
+// Row slot length marking a dictionary code rather than an inline value
+#define SAMPLE_CODED UINT_MAX32
+// Dictionary lookup result for a value with no code, to be stored inline
+#define SAMPLE_INLINE UINT_MAX32
 
 static uint sample_verbose;
 static uint sample_rate;
 static uint sample_limit;
+static ulonglong sample_memory_limit;
 
-static list_t *sample_tables;
-static pthread_mutex_t sample_tables_mutex;
+static MYSQL_THDVAR_BOOL(consume, PLUGIN_VAR_OPCMDARG,
+  "SELECT drains the table. When off, SELECT reads a snapshot and leaves rows in place until TRUNCATE.",
+  NULL, NULL, TRUE);
+
+// Open tables by path; readers look up and take a reference, writers
+// create, rename and drop
+static hash_t *sample_tables;
+static pthread_rwlock_t sample_tables_lock;
 
 static uint64 sample_seed;
-static pthread_mutex_t sample_seed_mutex;
 
 ulonglong sample_counter_rows_inserted;
-static pthread_mutex_t sample_stats_mutex;
+ulonglong sample_memory_used;
+ulonglong sample_rows_stored;
+ulonglong sample_compressed_bytes;
+ulonglong sample_uncompressed_bytes;
+ulonglong sample_rows_expired;
+ulonglong sample_rows_seen;
+ulonglong sample_rows_sampled;
+ulonglong sample_rows_dropped_limit;
+ulonglong sample_rows_dropped_contention;
+ulonglong sample_file_bytes_written;
+ulonglong sample_rows_spilled;
+ulonglong sample_spill_bytes;
+
+// Background writer for SAMPLE_DURABLE and SAMPLE_SPILL tables, deflater
+// for SAMPLE_COMPRESSION ones, and reclaimer of what finished statements read
+static pthread_t sample_flusher;
+static pthread_mutex_t sample_flusher_mutex;
+static pthread_cond_t sample_flusher_cond;
+static bool sample_flusher_stop;
+static bool sample_flusher_spill; // a table wants to spill now
+static uint sample_flusher_compress; // atomic, a full slab is waiting to be deflated
+static list_t *sample_reclaim;    // trash_t, under sample_flusher_mutex
 
 static handler *sample_create_handler(handlerton *hton, TABLE_SHARE *table, MEM_ROOT *mem_root);
 
 handlerton *sample_hton;
 
-struct ha_table_option_struct{};
-struct ha_field_option_struct{};
-ha_create_table_option sample_table_option_list[] = { HA_TOPTION_END };
-ha_create_table_option sample_field_option_list[] = { HA_FOPTION_END };
+struct ha_table_option_struct
+{
+  uint mode;
+  bool compression;
+  ulonglong window;
+  ulonglong rate;
+  ulonglong limit;
+  ulonglong target;
+  const char *key;
+  ulonglong quota;
+  const char *hash;
+  bool durable;
+  ulonglong spill;
+};
+
+struct ha_field_option_struct
+{
+  bool weight;
+  bool sketch;
+};
+
+ha_create_table_option sample_table_option_list[] = {
+  HA_TOPTION_ENUM("SAMPLE_MODE", mode, "APPEND,RESERVOIR", SAMPLE_MODE_APPEND),
+  HA_TOPTION_BOOL("SAMPLE_COMPRESSION", compression, 0),
+  HA_TOPTION_NUMBER("SAMPLE_WINDOW", window, 0, 0, UINT_MAX32, 1),
+  HA_TOPTION_NUMBER("SAMPLE_RATE", rate, 0, 0, UINT_MAX32, 1),
+  HA_TOPTION_NUMBER("SAMPLE_LIMIT", limit, 0, 0, UINT_MAX32, 1),
+  HA_TOPTION_NUMBER("SAMPLE_TARGET", target, 0, 0, UINT_MAX32, 1),
+  HA_TOPTION_STRING("SAMPLE_KEY", key),
+  HA_TOPTION_NUMBER("SAMPLE_QUOTA", quota, 16, 1, UINT_MAX32, 1),
+  HA_TOPTION_STRING("SAMPLE_HASH", hash),
+  HA_TOPTION_BOOL("SAMPLE_DURABLE", durable, 0),
+  HA_TOPTION_NUMBER("SAMPLE_SPILL", spill, 0, 0, UINT_MAX32, 1),
+  HA_TOPTION_END
+};
+
+ha_create_table_option sample_field_option_list[] = {
+  HA_FOPTION_BOOL("SAMPLE_WEIGHT", weight, 0),
+  HA_FOPTION_BOOL("SAMPLE_SKETCH", sketch, 0),
+  HA_FOPTION_END
+};
 
 static void sample_note(const char *format, ...)
 {
@@ -73,6 +170,13 @@ static void sample_error(const char *format, ...)
 #define sample_assert(f,...) do { if (!(f)) { sample_error(__VA_ARGS__); abort(); } } while(0)
 #define sample_debug(...) if (sample_verbose) sample_note(__VA_ARGS__)
 
+#define sample_atomic_load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define sample_atomic_store(p,v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define sample_atomic_swap(p,v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define sample_atomic_add(p,v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define sample_atomic_sub(p,v) __atomic_fetch_sub((p), (v), __ATOMIC_SEQ_CST)
+#define sample_atomic_cas(p,o,v) __sync_bool_compare_and_swap((p), (o), (v))
+
 static void* sample_alloc(size_t bytes)
 {
   void *ptr = my_malloc(bytes, MYF(MY_ZEROFILL));
@@ -107,6 +211,15 @@ static void str_free(str_t *str)
   sample_free(str);
 }
 
+static void str_reserve(str_t *str, size_t limit)
+{
+  if (limit > str->limit)
+  {
+    str->limit = limit;
+    str->buffer = (char*) sample_realloc(str->buffer, str->limit);
+  }
+}
+
 static void str_reset(str_t *str)
 {
   str->length = 0;
@@ -208,493 +321,3180 @@ static bool list_delete(list_t *list, void *item)
   return FALSE;
 }
 
-static SampleTable* sample_table_open(const char *name, uint width, uint rate, uint limit)
+static slab_t* slab_alloc(size_t limit)
 {
-  node_t *node = sample_tables->head;
-  while (node && strcmp(((SampleTable*)node->payload)->name, name) != 0)
-    node = node->next;
+  slab_t *slab = (slab_t*) sample_alloc(sizeof(slab_t) + limit);
+  slab->buffer = (uchar*)(slab+1);
+  slab->limit  = limit;
+  return slab;
+}
+
+static void slab_free(slab_t *slab)
+{
+  sample_free(slab);
+}
+
+// Slab rows are stored back to back as: uint length, payload, padding
+static size_t slab_row_width(uint length)
+{
+  return ALIGN_SIZE(sizeof(uint) + length);
+}
 
-  SampleTable *table = node ? (SampleTable*) node->payload: NULL;
+static arena_t* arena_alloc()
+{
+  void *base = sample_alloc(sizeof(arena_t) + SAMPLE_CACHE_LINE);
+
+  arena_t *arena = (arena_t*) MY_ALIGN((size_t) base, SAMPLE_CACHE_LINE);
+  arena->base = base;
+
+  pthread_mutex_init(&arena->mutex, NULL);
+  return arena;
+}
 
-  if (!table && width && rate)
+static void arena_free(arena_t *arena)
+{
+  slab_t *slabs[] = { arena->head, arena->spare };
+
+  for (uint i = 0; i < sizeof(slabs)/sizeof(slab_t*); i++)
   {
-    table = (SampleTable*) sample_alloc(sizeof(SampleTable));
+    while (slabs[i])
+    {
+      slab_t *slab = slabs[i];
+      slabs[i] = slab->next;
+      slab_free(slab);
+    }
+  }
+  pthread_mutex_destroy(&arena->mutex);
+  sample_free(arena->base);
+}
+
+// Drop one reference; the last one out recycles the slab
+static void slab_release(arena_t *arena, slab_t *slab)
+{
+  if (sample_atomic_sub(&slab->refs, 1) > 1)
+    return;
 
-    table->name = (char*) sample_alloc(strlen(name)+1);
-    strcpy(table->name, name);
+  if (slab->limit == SAMPLE_SLAB_SIZE)
+  {
+    pthread_mutex_lock(&arena->mutex);
+    if (arena->spares < SAMPLE_SLAB_SPARES)
+    {
+      slab->next = arena->spare;
+      arena->spare = slab;
+      arena->spares++;
+      slab = NULL;
+    }
+    pthread_mutex_unlock(&arena->mutex);
+  }
 
-    table->width = width;
-    table->rate  = rate;
-    table->limit = limit;
-    table->rows  = list_alloc();
+  if (slab)
+    slab_free(slab);
+}
 
-    pthread_mutex_init(&table->mutex, NULL);
+// Take an empty slab from the spares, or allocate one
+static slab_t* arena_spare(arena_t *arena, size_t bytes)
+{
+  slab_t *slab = NULL;
 
-    thr_lock_init(&table->mysql_lock);
+  if (bytes <= SAMPLE_SLAB_SIZE)
+  {
+    pthread_mutex_lock(&arena->mutex);
+    if ((slab = arena->spare))
+    {
+      arena->spare = slab->next;
+      arena->spares--;
+    }
+    pthread_mutex_unlock(&arena->mutex);
   }
 
-  return table;
+  if (!slab)
+    slab = slab_alloc(MY_MAX(bytes, SAMPLE_SLAB_SIZE));
+
+  slab->next     = NULL;
+  slab->length   = 0;
+  slab->raw      = 0;
+  slab->rows     = 0;
+  slab->shard    = 0;
+  slab->settled_rows  = 0;
+  slab->settled_bytes = 0;
+  slab->refs     = 1;
+  slab->writing  = 0;
+  slab->detached = 0;
+  slab->plain    = 0;
+
+  return slab;
 }
 
-static void sample_table_drop(SampleTable *table, bool hard)
+// Current time bucket of a windowed arena
+static uint64 arena_epoch(arena_t *arena)
 {
-  if (hard)
+  return arena->width ? (uint64) time(NULL) / arena->width: 0;
+}
+
+// Rows and bytes claimed by writers, summed over the shards
+static void arena_usage(arena_t *arena, uint64 *rows, uint64 *bytes)
+{
+  *rows = *bytes = 0;
+  for (uint i = 0; i < SAMPLE_SHARDS; i++)
   {
-    char fname[1024];
-    snprintf(fname, sizeof(fname), "%s.sample", table->name);
-    remove(fname);
+    *rows  += sample_atomic_load(&arena->shards[i].rows);
+    *bytes += sample_atomic_load(&arena->shards[i].bytes);
   }
+}
 
-  pthread_mutex_destroy(&table->mutex);
-  list_free(table->rows);
+// Whether a writer may store another row. Under its shard's even share
+// of the limits it decides from its own cache line; past that it sums
+// the shards, so a lone writer can still fill the table. Writers racing
+// at a limit may each pass it by a row.
+static bool arena_room(arena_t *arena, uint shard, uint64 row_limit, uint64 memory_limit)
+{
+  if (sample_atomic_load(&arena->shards[shard].rows) < row_limit / SAMPLE_SHARDS
+    && sample_atomic_load(&arena->shards[shard].bytes) < memory_limit / SAMPLE_SHARDS)
+    return TRUE;
 
-  thr_lock_delete(&table->mysql_lock);
-  list_delete(sample_tables, table);
-  sample_free(table->name);
-  sample_free(table);
+  uint64 rows, bytes;
+  arena_usage(arena, &rows, &bytes);
+
+  return rows < row_limit && bytes < memory_limit;
 }
 
-static uchar sample_field_type(uchar *row)
+// Shard for the CPU a writer is on now. Writers pick again each time
+// they take a slab, so they follow the scheduler rather than keeping the
+// shard they opened on. Past SAMPLE_SHARDS CPUs, some CPUs share one.
+static uint arena_shard()
 {
-  return *row;
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0: (uint) cpu % SAMPLE_SHARDS;
 }
 
-static uchar* sample_field_buffer(uchar *row)
+static void arena_push(arena_t *arena, slab_t *slab)
 {
-  uchar type = *row++;
-  switch (type) {
-    case SAMPLE_STRING:
-      row += sizeof(uint);
-      break;
-    case SAMPLE_TINYSTRING:
-      row += sizeof(uint8_t);
-      break;
-    case SAMPLE_NULL:
-    case SAMPLE_INT64:
-    case SAMPLE_INT32:
-    case SAMPLE_INT08:
-      break;
-  }
-  return row;
+  slab->id = sample_atomic_add(&arena->ids, 1) + 1;
+
+  do {
+    slab->next = sample_atomic_load(&arena->head);
+  } while (!sample_atomic_cas(&arena->head, slab->next, slab));
 }
 
-static uint sample_field_length(uchar *row)
+// Take a fresh slab, owned by the caller and already published on the
+// arena stack so a drain sees its rows without the owner's help
+static slab_t* arena_slab(arena_t *arena, size_t bytes, uint64 epoch, uint shard)
 {
-  uint length = 0;
-  uchar type = *row++;
-  switch (type) {
-    case SAMPLE_NULL:
-      break;
-    case SAMPLE_STRING:
-      length = *((uint*)row);
-      break;
-    case SAMPLE_TINYSTRING:
-      length = *((uint8_t*)row);
-      break;
-    case SAMPLE_INT64:
-      length = sizeof(int64_t);
-      break;
-    case SAMPLE_INT32:
-      length = sizeof(int32_t);
-      break;
-    case SAMPLE_INT08:
-      length = sizeof(int8_t);
-      break;
-  }
-  return length;
+  slab_t *slab = arena_spare(arena, bytes);
+
+  slab->refs    = 2; // owner + arena stack
+  slab->writing = 1;
+  slab->epoch   = epoch;
+  slab->shard   = shard;
+
+  arena_push(arena, slab);
+
+  return slab;
 }
 
-static uint64 sample_field_width(uchar *row)
+// Put another slab, or the rest of the chain, where slab is linked. Caller
+// holds arena->mutex. Writers only ever push at the head, so once off the
+// head the link before a slab is stable while the mutex is held.
+static void arena_replace(arena_t *arena, slab_t *slab, slab_t *with)
 {
-  uint64 length = 1;
-  uchar type = *row++;
-  switch (type) {
-    case SAMPLE_NULL:
-      break;
-    case SAMPLE_STRING:
-      length += *((uint*)row) + sizeof(uint);
-      break;
-    case SAMPLE_TINYSTRING:
-      length += *((uint8_t*)row) + sizeof(uint8_t);
-      break;
-    case SAMPLE_INT64:
-      length += sizeof(int64_t);
-      break;
-    case SAMPLE_INT32:
-      length += sizeof(int32_t);
-      break;
-    case SAMPLE_INT08:
-      length += sizeof(int8_t);
-      break;
+  if (!sample_atomic_cas(&arena->head, slab, with))
+  {
+    slab_t *prev = sample_atomic_load(&arena->head);
+    while (prev->next != slab)
+      prev = prev->next;
+    prev->next = with;
   }
-  return length;
 }
 
-static bool sample_show_status(handlerton* hton, THD* thd, stat_print_fn* stat_print, enum ha_stat_type stat_type)
+// Wait out writers still landing rows in slabs detached under
+// arena->mutex, then take the chain's rows and bytes off the books
+static void arena_retire(arena_t *arena, slab_t *slabs)
 {
-  str_t *str = str_alloc(100);
+  uint64 rows = 0, bytes = 0, zbytes = 0, raw = 0;
 
-  str_print(str, "hello");
+  for (slab_t *slab = slabs; slab; slab = slab->next)
+  {
+    while (sample_atomic_load(&slab->writing))
+      sched_yield();
 
-  stat_print(thd, STRING_WITH_LEN("SAMPLE"), STRING_WITH_LEN("stuff"), str->buffer, str->length);
+    sample_atomic_sub(&arena->shards[slab->shard].rows, slab->rows);
+    sample_atomic_sub(&arena->shards[slab->shard].bytes, slab->length);
 
-  str_reset(str);
-  str_free(str);
+    // Only what the owner got round to adding
+    rows  += slab->settled_rows;
+    bytes += slab->settled_bytes;
 
-  return FALSE; // success
+    if (slab->raw)
+    {
+      zbytes += slab->length;
+      raw    += slab->raw;
+    }
+  }
+
+  sample_atomic_sub(&sample_rows_stored, rows);
+  sample_atomic_sub(&sample_memory_used, bytes);
+  sample_atomic_sub(&sample_compressed_bytes, zbytes);
+  sample_atomic_sub(&sample_uncompressed_bytes, raw);
 }
 
-static int sample_init_func(void *p)
+// Swap a slab its owner has let go of for a deflated copy. Done on the
+// flusher thread, which holds a reference in place of the owner's, so a
+// whole slab is compressed at once and nothing else is writing it.
+// Readers already holding the original keep it until they release it.
+static void arena_compress(arena_t *arena, slab_t *slab)
 {
-  sample_hton = (handlerton*)p;
+  uLongf zlength = compressBound(slab->length);
+  uchar *zbuffer = (uchar*) sample_alloc(zlength);
 
-  sample_hton->state  = SHOW_OPTION_YES;
-  sample_hton->create = sample_create_handler;
+  if (compress2(zbuffer, &zlength, slab->buffer, slab->length, Z_BEST_SPEED) != Z_OK
+    || zlength >= slab->length)
+  {
+    // Not tried again
+    sample_atomic_store(&slab->plain, 1);
+    sample_free(zbuffer);
+    slab_release(arena, slab);
+    return;
+  }
 
-  sample_hton->flags
-  = HTON_CAN_RECREATE
-  | HTON_TEMPORARY_NOT_SUPPORTED
-  | HTON_NO_PARTITION
-  | HTON_SUPPORT_LOG_TABLES;
+  slab_t *zslab = slab_alloc(zlength);
+  memcpy(zslab->buffer, zbuffer, zlength);
+  sample_free(zbuffer);
 
-  sample_hton->table_options = sample_table_option_list;
-  sample_hton->field_options = sample_field_option_list;
-  sample_hton->show_status = sample_show_status;
+  zslab->length = zlength;
+  zslab->raw    = slab->length;
+  zslab->rows   = slab->rows;
+  zslab->epoch  = slab->epoch;
+  zslab->id     = slab->id;
+  zslab->shard  = slab->shard;
+  zslab->refs   = 1; // arena stack
 
-  sample_seed = 1;
+  // The owner settled the whole slab before letting go
+  zslab->settled_rows  = slab->settled_rows;
+  zslab->settled_bytes = zlength;
 
-  pthread_mutex_init(&sample_tables_mutex, NULL);
-  pthread_mutex_init(&sample_seed_mutex, NULL);
-  pthread_mutex_init(&sample_stats_mutex, NULL);
+  // Counted before zslab can be drained, which takes these off again
+  sample_atomic_add(&sample_compressed_bytes, zlength);
+  sample_atomic_add(&sample_uncompressed_bytes, slab->length);
 
-  sample_tables = list_alloc();
+  pthread_mutex_lock(&arena->mutex);
 
-  return 0;
-}
+  // Drained since the owner let go; it's the reader's now
+  if (sample_atomic_load(&slab->detached))
+  {
+    pthread_mutex_unlock(&arena->mutex);
+    sample_atomic_sub(&sample_compressed_bytes, zlength);
+    sample_atomic_sub(&sample_uncompressed_bytes, slab->length);
+    slab_free(zslab);
+    slab_release(arena, slab);
+    return;
+  }
 
-static int sample_done_func(void *p)
-{
-  pthread_mutex_destroy(&sample_tables_mutex);
-  pthread_mutex_destroy(&sample_seed_mutex);
-  pthread_mutex_destroy(&sample_stats_mutex);
+  zslab->next = slab->next;
+  arena_replace(arena, slab, zslab);
 
-  while (!list_is_empty(sample_tables))
-    sample_table_drop((SampleTable*)list_remove_head(sample_tables), FALSE);
-  list_free(sample_tables);
+  pthread_mutex_unlock(&arena->mutex);
 
-  return 0;
+  size_t saved = slab->length - zlength;
+  sample_atomic_sub(&arena->shards[slab->shard].bytes, saved);
+  sample_atomic_sub(&sample_memory_used, saved);
+
+  // Owner's reference, and the arena stack's which passed to zslab
+  slab_release(arena, slab);
+  slab_release(arena, slab);
 }
 
-static handler* sample_create_handler(handlerton *hton, TABLE_SHARE *table, MEM_ROOT *mem_root)
+// Add the rows an owner stored since last time to the global gauges, in
+// batches rather than a shared counter per row. Only inside the writing
+// window, so arena_retire() takes off exactly what was added.
+static void slab_settle(slab_t *slab)
 {
-  return new (mem_root) ha_sample(hton, table);
+  sample_atomic_add(&sample_rows_stored, slab->rows - slab->settled_rows);
+  sample_atomic_add(&sample_memory_used, slab->length - slab->settled_bytes);
+
+  slab->settled_rows  = slab->rows;
+  slab->settled_bytes = slab->length;
 }
 
-ha_sample::ha_sample(handlerton *hton, TABLE_SHARE *table_arg)
-  :handler(hton, table_arg)
+// Settle an owned slab outside of a row, unless it was drained meanwhile
+static void arena_settle(slab_t *slab)
 {
-  sample_debug("%s", __func__);
-  sample_table = NULL;
-  sample_trash = NULL;
-  sample_rows  = NULL;
-  sample_row   = NULL;
+  sample_atomic_store(&slab->writing, 1);
 
-  pthread_mutex_lock(&sample_seed_mutex);
-  srand48_r(sample_seed++, &sample_rand);
-  pthread_mutex_unlock(&sample_seed_mutex);
-}
+  if (!sample_atomic_load(&slab->detached))
+    slab_settle(slab);
 
-static const char *ha_sample_exts[] = {
-  NullS
-};
+  sample_atomic_store(&slab->writing, 0);
+}
 
-const char **ha_sample::bas_ext() const
+// Have the flusher deflate the slabs writers let go of, once per round
+// however many fill meanwhile
+static void sample_compress_wake()
 {
-  sample_debug("%s", __func__);
-  return ha_sample_exts;
+  if (!sample_atomic_cas(&sample_flusher_compress, 0, 1))
+    return;
+
+  pthread_mutex_lock(&sample_flusher_mutex);
+  pthread_cond_signal(&sample_flusher_cond);
+  pthread_mutex_unlock(&sample_flusher_mutex);
 }
 
-void ha_sample::empty_trash()
+// Reserve space for a row of length bytes in the caller's own slab and
+// return where the payload goes. Must be followed by arena_place_end().
+// The writing/detached pair is a Dekker handshake with arena_drain(): the
+// owner either sees the slab detached and moves on, or the drain waits
+// for the row to land.
+// In a windowed arena a slab only takes rows from its own time bucket.
+static uchar* arena_place(arena_t *arena, slab_t **owned, uint length)
 {
-  if (sample_trash)
+  size_t bytes = slab_row_width(length);
+  uint64 epoch = arena_epoch(arena);
+
+  slab_t *slab = *owned;
+  if (slab)
   {
-    while (sample_trash->length)
-      sample_free(list_remove_head(sample_trash));
+    sample_atomic_store(&slab->writing, 1);
 
-    list_free(sample_trash);
-    sample_trash = NULL;
-  }
-}
+    bool detached = sample_atomic_load(&slab->detached);
+    bool full = detached || slab->length + bytes > slab->limit || slab->epoch != epoch;
 
-void ha_sample::use_trash()
-{
-  if (!sample_trash)
-    sample_trash = list_alloc();
-}
+    if (!detached && (full || slab->rows - slab->settled_rows >= SAMPLE_SETTLE))
+      slab_settle(slab);
 
-int ha_sample::open(const char *name, int mode, uint test_if_locked)
-{
-  sample_debug("%s %s", __func__, name);
-  reset();
+    if (full)
+    {
+      sample_atomic_store(&slab->writing, 0);
 
-  pthread_mutex_lock(&sample_tables_mutex);
+      slab_release(arena, slab);
 
-  sample_table = sample_table_open(name, table->s->fields, sample_rate, sample_limit);
-  thr_lock_data_init(&sample_table->mysql_lock, &lock, NULL);
-  sample_table->users++;
+      // Deflated off the INSERT path
+      if (!detached && sample_atomic_load(&arena->compress))
+        sample_compress_wake();
+
+      slab = NULL;
+    }
+  }
 
-  pthread_mutex_unlock(&sample_tables_mutex);
-  counter_rows_inserted = 0;
+  if (!slab)
+    slab = *owned = arena_slab(arena, bytes, epoch, arena_shard());
 
-  return sample_table ? 0: -1;
+  uchar *ptr = slab->buffer + slab->length;
+  *((uint*)ptr) = length;
+
+  return ptr + sizeof(uint);
 }
 
-int ha_sample::close(void)
+static void arena_place_end(slab_t *slab, uint length)
 {
-  sample_debug("%s", __func__);
+  slab->rows++;
+  sample_atomic_store(&slab->length, slab->length + slab_row_width(length));
+  sample_atomic_store(&slab->writing, 0);
+}
 
-  pthread_mutex_lock(&sample_tables_mutex);
+// Detach every published slab with one exchange. The caller inherits the
+// arena stack's reference on each and hands them back via slab_release().
+// arena->mutex only keeps arena_snapshot() from walking a chain mid-drain;
+// writers never take it.
+static slab_t* arena_drain(arena_t *arena)
+{
+  pthread_mutex_lock(&arena->mutex);
 
-  sample_table->users--;
-  sample_table = NULL;
+  slab_t *slabs = sample_atomic_swap(&arena->head, (slab_t*)NULL);
 
-  pthread_mutex_unlock(&sample_tables_mutex);
+  // Marked under the mutex so arena_compress() never relinks a drained chain
+  for (slab_t *slab = slabs; slab; slab = slab->next)
+    sample_atomic_store(&slab->detached, 1);
 
-  empty_trash();
+  pthread_mutex_unlock(&arena->mutex);
 
-  pthread_mutex_lock(&sample_stats_mutex);
-  sample_counter_rows_inserted += counter_rows_inserted;
-  pthread_mutex_unlock(&sample_stats_mutex);
+  arena_retire(arena, slabs);
 
-  return 0;
+  return slabs;
 }
 
-int ha_sample::record_store(SampleRow *row, uchar *buf)
+// Free every slab whose time bucket has left the window. Whole slabs go
+// at once, and only the first caller after the window moves does any
+// work; everyone else returns after one comparison.
+static void arena_expire(arena_t *arena)
 {
-  if (!row)
-    return HA_ERR_END_OF_FILE;
+  if (!arena->width)
+    return;
 
-  memset(buf, 0, table->s->null_bytes);
-  // Avoid asserts in ::store() for columns that are not going to be updated
-  my_bitmap_map *org_bitmap = dbug_tmp_use_all_columns(table, table->write_set);
+  uint64 now = time(NULL);
+  if (now < arena->window)
+    return;
 
-  uchar *buff = row->buffer;
+  // Everything in buckets before this one is older than the window
+  uint64 cutoff  = (now - arena->window) / arena->width;
+  uint64 expired = sample_atomic_load(&arena->expired);
 
-  for (uint col = 0; col < sample_table->width; col++)
-  {
-    Field *field = table->field[col];
+  if (expired >= cutoff || !sample_atomic_cas(&arena->expired, expired, cutoff))
+    return;
 
-    uchar  type   = sample_field_type(buff);
-    uchar *buffer = sample_field_buffer(buff);
-    uint   length = sample_field_length(buff);
+  slab_t *slabs = NULL, *next = NULL;
 
-    switch (type) {
-      case SAMPLE_NULL:
-        field->set_null();
-        break;
-      case SAMPLE_STRING:
-        field->store((char*)buffer, length, &my_charset_bin, CHECK_FIELD_WARN);
-        break;
-      case SAMPLE_TINYSTRING:
-        field->store((char*)buffer, length, &my_charset_bin, CHECK_FIELD_WARN);
-        break;
-      case SAMPLE_INT64:
-        field->store(*((int64_t*)buffer), FALSE);
-        break;
-      case SAMPLE_INT32:
-        field->store(*((int32_t*)buffer), FALSE);
-        break;
-      case SAMPLE_INT08:
-        field->store(*((int8_t*)buffer), FALSE);
-        break;
-    }
+  pthread_mutex_lock(&arena->mutex);
 
-    buff += sample_field_width(buff);
+  for (slab_t *slab = sample_atomic_load(&arena->head); slab; slab = next)
+  {
+    next = slab->next;
+    if (slab->epoch < cutoff)
+    {
+      arena_replace(arena, slab, next);
+      sample_atomic_store(&slab->detached, 1);
+      slab->next = slabs;
+      slabs = slab;
+    }
   }
-  dbug_tmp_restore_column_map(table->write_set, org_bitmap);
-  return 0;
 
-  return 0;
+  pthread_mutex_unlock(&arena->mutex);
+
+  arena_retire(arena, slabs);
+
+  for (slab_t *slab = slabs; slab; slab = next)
+  {
+    next = slab->next;
+    sample_atomic_add(&sample_rows_expired, slab->rows);
+    slab_release(arena, slab);
+  }
 }
 
-SampleRow* ha_sample::record_place(uchar *buf)
+// <name>.sample, or a variant of it
+static void sample_file_name(char *buf, size_t size, const char *name, const char *suffix)
 {
-  SampleRow *row = (SampleRow*) sample_alloc(sizeof(SampleRow));
+  snprintf(buf, size, "%s.sample%s", name, suffix);
+}
 
-  str_t *str = str_alloc(32);
+// Every file a table may have beside it
+static const char *sample_file_exts[] = { "", ".spill", NullS };
 
-  for (uint col = 0; col < table->s->fields; col++)
+static void sample_file_remove(const char *name)
+{
+  char fname[FN_REFLEN];
+  for (const char **ext = sample_file_exts; *ext; ext++)
   {
-    Field *field = table->field[col];
-
-    if (field->is_null())
-    {
-      uchar type = SAMPLE_NULL;
-      str_cat(str, (char*)&type, sizeof(uchar));
-    }
-    else
-    if (field->result_type() == INT_RESULT)
-    {
-      uchar type;
-      int64 n = field->val_int();
-      if (n > -128 && n < 128)
-      {
-        int8_t n8 = n;
-        type = SAMPLE_INT08;
-        str_cat(str, (char*)&type, sizeof(uchar));
-        str_cat(str, (char*)&n8, sizeof(int8_t));
-      }
-      else
-      if (n > INT_MIN && n < INT_MAX)
-      {
-        int32_t n32 = n;
-        type = SAMPLE_INT32;
-        str_cat(str, (char*)&type, sizeof(uchar));
-        str_cat(str, (char*)&n32, sizeof(int32_t));
-      }
-      else
-      {
-        type = SAMPLE_INT64;
-        str_cat(str, (char*)&type, sizeof(uchar));
-        str_cat(str, (char*)&n, sizeof(int64_t));
-      }
-    }
-    else
-    {
-      char pad[1024];
-      String tmp(pad, sizeof(pad), &my_charset_bin);
-      field->val_str(&tmp, &tmp);
-
-      if (tmp.length() < 256)
-      {
-        uchar length = tmp.length();
-        uchar type = SAMPLE_TINYSTRING;
-        str_cat(str, (char*)&type, sizeof(uchar));
-        str_cat(str, (char*)&length, sizeof(uchar));
-        str_cat(str, tmp.ptr(), tmp.length());
-      }
-      else
-      {
-        uint length = tmp.length();
-        uchar type = SAMPLE_STRING;
-        str_cat(str, (char*)&type, sizeof(uchar));
-        str_cat(str, (char*)&length, sizeof(uint));
-        str_cat(str, tmp.ptr(), tmp.length());
-      }
-    }
+    sample_file_name(fname, sizeof(fname), name, *ext);
+    remove(fname);
   }
+}
 
-  row->buffer = (uchar*)str->buffer;
-  row->length = str->length;
-  str->buffer = NULL;
-
-  str_free(str);
-
-  return row;
+static void sample_file_rename(const char *from, const char *to)
+{
+  char fname[FN_REFLEN], tname[FN_REFLEN];
+  for (const char **ext = sample_file_exts; *ext; ext++)
+  {
+    sample_file_name(fname, sizeof(fname), from, *ext);
+    sample_file_name(tname, sizeof(tname), to, *ext);
+    rename(fname, tname);
+  }
 }
 
-int ha_sample::write_row(uchar *buf)
+// Map a whole file read only, or NULL when it is empty
+static uchar* file_map(int fd, uint64 *size)
 {
-  sample_debug("%s", __func__);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+    return NULL;
 
-  long r; lrand48_r(&sample_rand, &r);
-  bool complete = r % sample_table->rate == 0;
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
 
-  if (complete)
-  {
-    // Avoid asserts in val_str() for columns that are not going to be updated
-    my_bitmap_map *org_bitmap = dbug_tmp_use_all_columns(table, table->read_set);
+  *size = st.st_size;
+  return (uchar*) map;
+}
 
-    SampleRow *row = record_place(buf);
+// A .sample file is a sequence of records, each a header and then bytes:
+// dictionary values in code order, and runs of rows in slab format
+enum {
+  SAMPLE_RECORD_ROWS=1, // a: rows, b: time bucket
+  SAMPLE_RECORD_VALUE,  // a: dictionary column, b: code
+};
 
-    bool inserted = FALSE;
+typedef struct record_st {
+  uint32 magic;
+  uint32 type;
+  uint64 a;
+  uint64 b;
+  uint32 length;  // bytes following
+  uint32 crc;     // crc32 of the header, with crc 0, and the bytes
+} record_t;
 
-    if (pthread_mutex_trylock(&sample_table->mutex) == 0)
-    {
-      if (sample_table->limit > sample_table->rows->length)
-      {
-        list_insert_head(sample_table->rows, row);
-        inserted = TRUE;
-      }
-      pthread_mutex_unlock(&sample_table->mutex);
-    }
+static uint32 record_crc(record_t *record, const uchar *buf)
+{
+  record_t header = *record;
+  header.crc = 0;
 
-    if (!inserted)
-    {
-      sample_free(row->buffer);
-      sample_free(row);
-    }
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, (const Bytef*) &header, sizeof(header));
+  crc = crc32(crc, buf, record->length);
 
-    dbug_tmp_restore_column_map(table->read_set, org_bitmap);
-    counter_rows_inserted++;
-  }
-  return 0;
+  return (uint32) crc;
 }
 
-int ha_sample::update_row(const uchar *old_data, uchar *new_data)
+static bool record_write(int fd, uint32 type, uint64 a, uint64 b, const uchar *buf, uint32 length, uint64 *bytes)
 {
-  return HA_ERR_WRONG_COMMAND;
+  record_t record;
+  memset(&record, 0, sizeof(record));
+
+  record.magic  = SAMPLE_FILE_MAGIC;
+  record.type   = type;
+  record.a      = a;
+  record.b      = b;
+  record.length = length;
+  record.crc    = record_crc(&record, buf);
+
+  if (write(fd, &record, sizeof(record)) != sizeof(record)
+    || write(fd, buf, length) != (ssize_t) length)
+    return FALSE;
+
+  *bytes += sizeof(record) + length;
+  sample_atomic_add(&sample_file_bytes_written, sizeof(record) + length);
+  return TRUE;
 }
 
-int ha_sample::delete_row(const uchar *buf)
+// The record at *offset in a mapped file and its bytes, moving *offset
+// past it; NULL at the end, or at a torn or corrupt record
+static const uchar* record_next(const uchar *map, uint64 size, uint64 *offset, record_t *record)
 {
-  return HA_ERR_WRONG_COMMAND;
+  if (*offset + sizeof(record_t) > size)
+    return NULL;
+
+  memcpy(record, map + *offset, sizeof(record_t));
+
+  const uchar *buf = map + *offset + sizeof(record_t);
+
+  if (record->magic != SAMPLE_FILE_MAGIC
+    || *offset + sizeof(record_t) + record->length > size
+    || record_crc(record, buf) != record->crc)
+    return NULL;
+
+  *offset += sizeof(record_t) + record->length;
+  return buf;
 }
 
-int ha_sample::rnd_init(bool scan)
+static cursor_t* cursor_alloc(uint64 count)
 {
-  sample_debug("%s", __func__);
-  rnd_end();
-  return 0;
+  cursor_t *cursor = (cursor_t*) sample_alloc(sizeof(cursor_t));
+  cursor->slabs   = (slab_t**) sample_alloc(sizeof(slab_t*) * MY_MAX(count, 1));
+  cursor->lengths = (size_t*) sample_alloc(sizeof(size_t) * MY_MAX(count, 1));
+  return cursor;
 }
 
-int ha_sample::rnd_end()
+// Release the cursor's reference on every slab, then the cursor. A
+// reader's share of a drain instead drops its reference on the drain,
+// and the last reader out frees that.
+static void cursor_free(cursor_t *cursor, arena_t *arena)
 {
-  sample_debug("%s", __func__);
+  if (cursor->scratch)
+    sample_free(cursor->scratch);
 
-  if (sample_row)
+  if (cursor->shared)
   {
-    sample_free(sample_row->buffer);
-    sample_free(sample_row);
+    if (sample_atomic_sub(&cursor->shared->readers, 1) == 1)
+      cursor_free(cursor->shared, arena);
+    sample_free(cursor);
+    return;
   }
 
-  while (sample_rows && sample_rows->length && (sample_row = (SampleRow*) list_remove_head(sample_rows)))
-  {
-    sample_free(sample_row->buffer);
-    sample_free(sample_row);
-  }
+  for (uint64 i = 0; i < cursor->count; i++)
+    slab_release(arena, cursor->slabs[i]);
 
-  list_free(sample_rows);
-  sample_rows = NULL;
-  sample_row  = NULL;
+  if (cursor->map)
+    munmap(cursor->map, cursor->mapped);
 
-  return 0;
+  sample_free(cursor->slabs);
+  sample_free(cursor->lengths);
+  sample_free(cursor);
 }
 
-int ha_sample::rnd_next(uchar *buf)
+// A reader of a drained cursor shared with others. Each slab, and each
+// spilled record, goes whole to whichever reader claims it first, so
+// concurrent readers split the rows with no row read twice.
+static cursor_t* cursor_join(cursor_t *shared)
 {
-  sample_debug("%s", __func__);
+  cursor_t *cursor = (cursor_t*) sample_alloc(sizeof(cursor_t));
 
-  if (!sample_rows)
-  {
-    list_t *list = list_alloc();
-    pthread_mutex_lock(&sample_table->mutex);
-    sample_rows = sample_table->rows;
-    sample_table->rows = list;
-    pthread_mutex_unlock(&sample_table->mutex);
-  }
+  sample_atomic_add(&shared->readers, 1);
 
-  if (sample_row)
-  {
-    sample_free(sample_row->buffer);
-    sample_free(sample_row);
-    sample_row = NULL;
-  }
+  cursor->shared  = shared;
+  cursor->slabs   = shared->slabs;
+  cursor->lengths = shared->lengths;
+  cursor->count   = shared->count;
+  cursor->map     = shared->map;
+  cursor->mapped  = shared->mapped;
+  cursor->expired = shared->expired;
+  cursor->index   = sample_atomic_add(&shared->claimed, 1);
 
-  if (sample_rows && sample_rows->length)
-    sample_row = (SampleRow*) list_remove_head(sample_rows);
+  return cursor;
+}
+
+// Nothing left for another reader to claim
+static bool cursor_done(cursor_t *shared)
+{
+  return sample_atomic_load(&shared->claimed) >= shared->count
+    && (!shared->map || sample_atomic_load(&shared->next) + sizeof(record_t) > shared->mapped);
+}
+
+// Wrap a detached chain; the cursor takes over the chain's references
+static cursor_t* cursor_chain(slab_t *slabs)
+{
+  uint64 count = 0;
+  for (slab_t *slab = slabs; slab; slab = slab->next)
+    count++;
+
+  cursor_t *cursor = cursor_alloc(count);
+
+  for (slab_t *slab = slabs; slab; slab = slab->next)
+  {
+    cursor->slabs[cursor->count] = slab;
+    cursor->lengths[cursor->count] = slab->raw ? slab->raw: slab->length;
+    cursor->count++;
+  }
+  return cursor;
+}
+
+// Rows of the current slab, inflating compressed slabs on first touch
+static uchar* cursor_buffer(cursor_t *cursor)
+{
+  slab_t *slab = cursor->slabs[cursor->index];
+
+  if (!slab->raw)
+    return slab->buffer;
+
+  if (cursor->inflated != cursor->index + 1)
+  {
+    if (cursor->limit < slab->raw)
+    {
+      if (cursor->scratch)
+        sample_free(cursor->scratch);
+      cursor->scratch = (uchar*) sample_alloc(slab->raw);
+      cursor->limit = slab->raw;
+    }
+
+    uLongf length = slab->raw;
+    int rc = uncompress(cursor->scratch, &length, slab->buffer, slab->length);
+    sample_assert(rc == Z_OK && length == slab->raw, "uncompress failed %d", rc);
+
+    cursor->inflated = cursor->index + 1;
+  }
+  return cursor->scratch;
+}
+
+// Rows of the spill file, a record at a time, once the slabs are done
+static bool cursor_spilled(cursor_t *cursor, SampleRow *row)
+{
+  cursor_t *shared = cursor->shared;
+
+  while (cursor->run >= cursor->end)
+  {
+    record_t record;
+    uint64 offset = cursor->next;
+
+    // Claim by the header's length alone; the checksum is the claimer's
+    while (shared)
+    {
+      offset = sample_atomic_load(&shared->next);
+      if (offset + sizeof(record_t) > cursor->mapped)
+        return FALSE;
+
+      memcpy(&record, cursor->map + offset, sizeof(record_t));
+      if (sample_atomic_cas(&shared->next, offset, offset + sizeof(record_t) + record.length))
+        break;
+    }
+
+    const uchar *buf = record_next(cursor->map, cursor->mapped, &offset, &record);
+
+    if (!buf)
+      return FALSE;
+
+    if (!shared)
+      cursor->next = offset;
+
+    // Slabs are spilled whole, so a window expires them whole as well
+    if (record.type != SAMPLE_RECORD_ROWS || record.b < cursor->expired)
+      continue;
+
+    cursor->run = buf - cursor->map;
+    cursor->end = cursor->run + record.length;
+  }
+
+  uchar *ptr = cursor->map + cursor->run;
+  row->length = *((uint*)ptr);
+  row->buffer = ptr + sizeof(uint);
+  cursor->run += slab_row_width(row->length);
+
+  return TRUE;
+}
+
+static bool cursor_next(cursor_t *cursor, SampleRow *row)
+{
+  while (cursor->index < cursor->count && cursor->offset >= cursor->lengths[cursor->index])
+  {
+    cursor->index = cursor->shared
+      ? sample_atomic_add(&cursor->shared->claimed, 1)
+      : cursor->index + 1;
+    cursor->offset = 0;
+  }
+
+  if (cursor->index >= cursor->count)
+    return cursor->map && cursor_spilled(cursor, row);
+
+  uchar *ptr = cursor_buffer(cursor) + cursor->offset;
+  row->length = *((uint*)ptr);
+  row->buffer = ptr + sizeof(uint);
+  cursor->offset += slab_row_width(row->length);
+
+  return TRUE;
+}
+
+// Reference every published slab and remember how much of each is filled.
+// Owners only ever append past that point, so the cursor reads a stable
+// prefix with no copying while inserts carry on.
+static cursor_t* arena_snapshot(arena_t *arena)
+{
+  pthread_mutex_lock(&arena->mutex);
+
+  slab_t *head = sample_atomic_load(&arena->head);
+
+  uint64 count = 0;
+  for (slab_t *slab = head; slab; slab = slab->next)
+    count++;
+
+  cursor_t *cursor = cursor_alloc(count);
+
+  for (slab_t *slab = head; slab && cursor->count < count; slab = slab->next)
+  {
+    sample_atomic_add(&slab->refs, 1);
+    cursor->slabs[cursor->count] = slab;
+    cursor->lengths[cursor->count] = slab->raw ? slab->raw: sample_atomic_load(&slab->length);
+    cursor->count++;
+  }
+
+  pthread_mutex_unlock(&arena->mutex);
+
+  return cursor;
+}
+
+// Slots are allocated as the reservoir fills, so a large row limit costs
+// nothing until the rows arrive
+static reservoir_t* reservoir_alloc(uint64 capacity)
+{
+  reservoir_t *res = (reservoir_t*) sample_alloc(sizeof(reservoir_t));
+  res->capacity = capacity;
+  res->next     = ULONGLONG_MAX;
+  rng_seed(&res->rng, sample_atomic_add(&sample_seed, 1));
+  return res;
+}
+
+static void reservoir_free(reservoir_t *res)
+{
+  sample_atomic_sub(&sample_rows_stored, res->filled);
+  sample_atomic_sub(&sample_memory_used, res->bytes);
+
+  for (uint64 i = 0; i < res->size; i++)
+  {
+    if (res->slots[i])
+      str_free(res->slots[i]);
+  }
+  sample_free(res->slots);
+  sample_free(res);
+}
+
+// Lock-free prefilter: is row n, counted from the last drain, a candidate?
+static bool reservoir_wants(reservoir_t *res, uint64 n)
+{
+  return n < res->capacity || n >= sample_atomic_load(&res->next);
+}
+
+// Algorithm L: the gap to the next accepted row, and the updated weight
+static void reservoir_skip(reservoir_t *res, uint64 n)
+{
+  res->w *= exp(log(rng_unit(&res->rng)) / res->capacity);
+  uint64 gap = (uint64) floor(log(rng_unit(&res->rng)) / log1p(-res->w));
+  sample_atomic_store(&res->next, n + gap + 1);
+}
+
+// Make room for row n unless that would take the reservoir over limit
+// bytes, and return where the caller writes it. *lost is set when row n
+// was wanted but a concurrent acceptor moved the reservoir on first.
+// Caller holds SampleTable::mutex. A concurrent drain or another acceptor
+// may have moved on since reservoir_wants(); fills go to the next free
+// slot regardless of n, and an index passed over while next was being
+// advanced is served by the first row to notice.
+static uchar* reservoir_place(reservoir_t *res, uint64 n, uint length, uint64 limit, bool *lost)
+{
+  uint64 slot, rows = 0, bytes = slab_row_width(length), evict = 0;
+
+  if (res->filled < res->capacity)
+  {
+    if (res->bytes + bytes > limit)
+      return NULL;
+
+    // Double the slots, up to the capacity
+    if (res->filled == res->size)
+    {
+      uint64 size = MY_MIN(MY_MAX(res->size * 2, SAMPLE_RESERVOIR_SLOTS), res->capacity);
+      res->slots = (str_t**) sample_realloc(res->slots, sizeof(str_t*) * size);
+      memset(res->slots + res->size, 0, sizeof(str_t*) * (size - res->size));
+      res->size = size;
+    }
+
+    slot = res->filled++;
+    rows = 1;
+
+    if (res->filled == res->capacity)
+    {
+      res->w = 1.0;
+      reservoir_skip(res, MY_MAX(n, res->capacity - 1));
+    }
+  }
+  else
+  if (n >= res->next)
+  {
+    slot  = rng_next(&res->rng) % res->capacity;
+    evict = slab_row_width(res->slots[slot]->length);
+
+    // Moving on regardless keeps the sample uniform over what fits
+    reservoir_skip(res, n);
+
+    if (res->bytes - evict + bytes > limit)
+      return NULL;
+  }
+  else
+  {
+    *lost = TRUE;
+    return NULL;
+  }
+
+  if (!res->slots[slot])
+    res->slots[slot] = str_alloc(length);
+
+  str_t *row = res->slots[slot];
+  str_reserve(row, length);
+  row->length = length;
+
+  res->bytes += bytes - evict;
+
+  sample_atomic_add(&sample_rows_stored, rows);
+  sample_atomic_add(&sample_memory_used, bytes - evict);
+
+  return (uchar*) row->buffer;
+}
+
+// Copy the sample out into unpublished slabs, continuing the chain
+// passed in. Caller holds SampleTable::mutex.
+static slab_t* reservoir_copy(reservoir_t *res, arena_t *arena, slab_t *slabs)
+{
+  for (uint64 i = 0; i < res->filled; i++)
+  {
+    str_t *row = res->slots[i];
+    size_t bytes = slab_row_width(row->length);
+
+    if (!slabs || slabs->length + bytes > slabs->limit)
+    {
+      slab_t *slab = arena_spare(arena, bytes);
+      slab->next = slabs;
+      slabs = slab;
+    }
+
+    uchar *ptr = slabs->buffer + slabs->length;
+    *((uint*)ptr) = row->length;
+    memcpy(ptr + sizeof(uint), row->buffer, row->length);
+
+    slabs->length += bytes;
+    slabs->rows++;
+  }
+  return slabs;
+}
+
+// Copy the sample out and start over. Slot buffers are kept, so a steady
+// state reservoir does not allocate, except ones grown past a slab for
+// some outsized row: those are off the books once the rows are gone.
+// Caller holds SampleTable::mutex.
+static slab_t* reservoir_drain(reservoir_t *res, arena_t *arena, slab_t *slabs)
+{
+  slabs = reservoir_copy(res, arena, slabs);
+
+  for (uint64 i = 0; i < res->filled; i++)
+  {
+    if (res->slots[i]->limit > SAMPLE_SLAB_SIZE)
+    {
+      str_free(res->slots[i]);
+      res->slots[i] = NULL;
+    }
+  }
+
+  sample_atomic_sub(&sample_rows_stored, res->filled);
+  sample_atomic_sub(&sample_memory_used, res->bytes);
+
+  res->filled = 0;
+  res->bytes  = 0;
+  res->next   = ULONGLONG_MAX;
+  sample_atomic_store(&res->seen, 0);
+
+  return slabs;
+}
+
+static uint64 hash_string(const char *str)
+{
+  // FNV-1a
+  uint64 h = 14695981039346656037ULL;
+  while (*str)
+  {
+    h ^= (uchar) *str++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static uint64 hash_bytes(const uchar *buf, size_t length)
+{
+  // FNV-1a
+  uint64 h = 14695981039346656037ULL;
+  while (length--)
+  {
+    h ^= *buf++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static hash_t* hash_alloc(uint64 width, key_fn key)
+{
+  hash_t *hash = (hash_t*) sample_alloc(sizeof(hash_t));
+  hash->buckets = (node_t**) sample_alloc(sizeof(node_t*) * width);
+  hash->width   = width;
+  hash->key     = key;
+  return hash;
+}
+
+static void hash_free(hash_t *hash)
+{
+  sample_free(hash->buckets);
+  sample_free(hash);
+}
+
+static node_t** hash_bucket(hash_t *hash, const char *key)
+{
+  return &hash->buckets[hash_string(key) & (hash->width-1)];
+}
+
+static void* hash_find(hash_t *hash, const char *key)
+{
+  node_t *node = *hash_bucket(hash, key);
+  while (node && strcmp(hash->key(node->payload), key) != 0)
+    node = node->next;
+  return node ? node->payload: NULL;
+}
+
+static void hash_resize(hash_t *hash, uint64 width)
+{
+  node_t **buckets = hash->buckets;
+  uint64 old_width = hash->width;
+
+  hash->buckets = (node_t**) sample_alloc(sizeof(node_t*) * width);
+  hash->width   = width;
+
+  for (uint64 i = 0; i < old_width; i++)
+  {
+    while (buckets[i])
+    {
+      node_t *node = buckets[i];
+      buckets[i] = node->next;
+
+      node_t **bucket = hash_bucket(hash, hash->key(node->payload));
+      node->next = *bucket;
+      *bucket = node;
+    }
+  }
+  sample_free(buckets);
+}
+
+static void hash_insert(hash_t *hash, void *item)
+{
+  if (hash->length >= hash->width)
+    hash_resize(hash, hash->width * 2);
+
+  node_t **bucket = hash_bucket(hash, hash->key(item));
+
+  node_t *node = (node_t*) sample_alloc(sizeof(node_t));
+  node->payload = item;
+  node->next = *bucket;
+  *bucket = node;
+  hash->length++;
+}
+
+static bool hash_delete(hash_t *hash, void *item)
+{
+  node_t **prev = hash_bucket(hash, hash->key(item));
+  while (*prev && (*prev)->payload != item)
+    prev = &(*prev)->next;
+
+  if (*prev)
+  {
+    node_t *node = *prev;
+    *prev = node->next;
+    hash->length--;
+    sample_free(node);
+    return TRUE;
+  }
+  return FALSE;
+}
+
+static void* hash_any(hash_t *hash)
+{
+  for (uint64 i = 0; i < hash->width; i++)
+  {
+    if (hash->buckets[i])
+      return hash->buckets[i]->payload;
+  }
+  return NULL;
+}
+
+// Bytes held are added to *total as well, the table's figure for all its
+// dictionaries
+static dict_t* dict_alloc(uint64 *total)
+{
+  dict_t *dict = (dict_t*) sample_alloc(sizeof(dict_t));
+  dict->total = total;
+  pthread_mutex_init(&dict->mutex, NULL);
+  return dict;
+}
+
+// Forget every value. Only when nothing can look a code up meanwhile.
+static void dict_reset(dict_t *dict)
+{
+  for (uint32 code = 0; code < dict->count; code++)
+    sample_free(dict->values[code]);
+
+  sample_atomic_sub(&sample_memory_used, dict->bytes);
+  sample_atomic_sub(dict->total, dict->bytes);
+
+  memset(dict->values, 0, sizeof(dict->values));
+  memset(dict->lengths, 0, sizeof(dict->lengths));
+  memset(dict->slots, 0, sizeof(dict->slots));
+  dict->bytes = 0;
+  sample_atomic_store(&dict->count, 0);
+}
+
+static void dict_free(dict_t *dict)
+{
+  dict_reset(dict);
+  pthread_mutex_destroy(&dict->mutex);
+  sample_free(dict);
+}
+
+// Lock free; a published slot always points at a complete entry
+static uint32 dict_probe(dict_t *dict, uint64 h, const uchar *buf, uint32 length)
+{
+  for (uint32 i = 0; i < SAMPLE_DICTIONARY_SLOTS; i++)
+  {
+    uint32 slot = sample_atomic_load(&dict->slots[(h + i) & (SAMPLE_DICTIONARY_SLOTS-1)]);
+
+    if (!slot)
+      break;
+
+    uint32 code = slot-1;
+    if (dict->lengths[code] == length && memcmp(dict->values[code], buf, length) == 0)
+      return code;
+  }
+  return SAMPLE_INLINE;
+}
+
+// Code for a value, adding it while there is room in both codes and
+// SAMPLE_DICTIONARY_BYTES. SAMPLE_INLINE means the value has to be stored
+// inline.
+static uint32 dict_code(dict_t *dict, const uchar *buf, uint32 length)
+{
+  if (length > SAMPLE_DICTIONARY_VALUE)
+    return SAMPLE_INLINE;
+
+  uint64 h = hash_bytes(buf, length);
+  uint32 code = dict_probe(dict, h, buf, length);
+
+  if (code != SAMPLE_INLINE || sample_atomic_load(&dict->count) == SAMPLE_DICTIONARY_CODES)
+    return code;
+
+  pthread_mutex_lock(&dict->mutex);
+
+  // Someone else may have added it
+  code = dict_probe(dict, h, buf, length);
+
+  size_t bytes = sizeof(uint32) + length;
+
+  if (code == SAMPLE_INLINE && dict->count < SAMPLE_DICTIONARY_CODES
+    && dict->bytes + bytes <= SAMPLE_DICTIONARY_BYTES)
+  {
+    code = dict->count;
+
+    dict->values[code] = (uchar*) sample_alloc(length + 1);
+    memcpy(dict->values[code], buf, length);
+    dict->lengths[code] = length;
+
+    uint32 i = h & (SAMPLE_DICTIONARY_SLOTS-1);
+    while (dict->slots[i])
+      i = (i + 1) & (SAMPLE_DICTIONARY_SLOTS-1);
+
+    sample_atomic_store(&dict->slots[i], code+1);
+    sample_atomic_store(&dict->count, code+1);
+
+    dict->bytes += bytes;
+    sample_atomic_add(&sample_memory_used, bytes);
+    sample_atomic_add(dict->total, bytes);
+  }
+
+  pthread_mutex_unlock(&dict->mutex);
+  return code;
+}
+
+static double sketch_double(uint64 bits)
+{
+  double x;
+  memcpy(&x, &bits, sizeof(x));
+  return x;
+}
+
+static uint64 sketch_bits(double x)
+{
+  uint64 bits;
+  memcpy(&bits, &x, sizeof(bits));
+  return bits;
+}
+
+static void sketch_init(sketch_t *sketch, Field *field, uint col)
+{
+  sketch->field = col;
+  sketch->name  = (char*) sample_alloc(strlen(field->field_name)+1);
+  strcpy(sketch->name, field->field_name);
+
+  sketch->numeric = field->cmp_type() == INT_RESULT
+    || field->cmp_type() == REAL_RESULT
+    || field->cmp_type() == DECIMAL_RESULT;
+
+  sketch->min = sketch_bits(HUGE_VAL);
+  sketch->max = sketch_bits(-HUGE_VAL);
+
+  pthread_mutex_init(&sketch->mutex, NULL);
+
+  sample_atomic_add(&sample_memory_used, sizeof(sketch_t));
+}
+
+static void sketch_reset(sketch_t *sketch)
+{
+  pthread_mutex_lock(&sketch->mutex);
+
+  for (uint i = 0; i < sketch->tops; i++)
+    str_free(sketch->top[i].value);
+  memset(sketch->top, 0, sizeof(sketch->top));
+  sketch->tops = 0;
+  sample_atomic_store(&sketch->floor, 0);
+
+  pthread_mutex_unlock(&sketch->mutex);
+
+  // Rows landing meanwhile may survive; these are estimates anyway
+  sample_atomic_store(&sketch->rows, 0);
+  sample_atomic_store(&sketch->zero, 0);
+  sample_atomic_store(&sketch->min, sketch_bits(HUGE_VAL));
+  sample_atomic_store(&sketch->max, sketch_bits(-HUGE_VAL));
+  memset(sketch->hll, 0, sizeof(sketch->hll));
+  memset(sketch->cms, 0, sizeof(sketch->cms));
+  memset(sketch->pos, 0, sizeof(sketch->pos));
+  memset(sketch->neg, 0, sizeof(sketch->neg));
+}
+
+static void sketch_free(sketch_t *sketch)
+{
+  sketch_reset(sketch);
+  pthread_mutex_destroy(&sketch->mutex);
+  sample_free(sketch->name);
+
+  sample_atomic_sub(&sample_memory_used, sizeof(sketch_t));
+}
+
+// HyperLogLog: keep the longest run of leading zeros per register
+static void sketch_distinct(sketch_t *sketch, uint64 h)
+{
+  uint reg = h >> (64 - SAMPLE_SKETCH_HLL_BITS);
+  uint64 w = (h << SAMPLE_SKETCH_HLL_BITS) | (1ULL << (SAMPLE_SKETCH_HLL_BITS-1));
+  uchar rank = __builtin_clzll(w) + 1;
+
+  uchar old = sample_atomic_load(&sketch->hll[reg]);
+  while (rank > old && !sample_atomic_cas(&sketch->hll[reg], old, rank))
+    old = sample_atomic_load(&sketch->hll[reg]);
+}
+
+static double sketch_distinct_estimate(sketch_t *sketch)
+{
+  double m = 1 << SAMPLE_SKETCH_HLL_BITS, sum = 0;
+  uint zeros = 0;
+
+  for (uint i = 0; i < (1 << SAMPLE_SKETCH_HLL_BITS); i++)
+  {
+    uchar reg = sample_atomic_load(&sketch->hll[i]);
+    sum += ldexp(1.0, -reg);
+    zeros += reg == 0;
+  }
+
+  double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+  // Linear counting while many registers are still empty
+  if (e <= 2.5 * m && zeros)
+    e = m * log(m / zeros);
+
+  return e;
+}
+
+// Count-Min: bump one counter per row of the sketch and return the
+// smallest, which over-counts by collisions only
+static uint64 sketch_count(sketch_t *sketch, uint64 h)
+{
+  uint64 count = UINT_MAX32;
+
+  for (uint d = 0; d < SAMPLE_SKETCH_CMS_DEPTH; d++)
+  {
+    uint i = rng_mix(h + d * 0x9E3779B97F4A7C15ULL) & (SAMPLE_SKETCH_CMS_WIDTH-1);
+    count = MY_MIN(count, (uint64) sample_atomic_add(&sketch->cms[d][i], 1) + 1);
+  }
+  return count;
+}
+
+// Heavy hitters: keep the values with the largest counts seen so far.
+// Most rows fail the floor check; the rest skip the update if someone
+// else has the mutex rather than queue for it.
+static void sketch_top(sketch_t *sketch, uint64 h, uint64 count, String *value)
+{
+  if (sample_atomic_load(&sketch->tops) == SAMPLE_SKETCH_TOP
+    && count <= sample_atomic_load(&sketch->floor))
+    return;
+
+  if (pthread_mutex_trylock(&sketch->mutex))
+    return;
+
+  top_t *top = NULL;
+
+  for (uint i = 0; !top && i < sketch->tops; i++)
+  {
+    if (sketch->top[i].hash == h)
+      top = &sketch->top[i];
+  }
+
+  if (!top && sketch->tops < SAMPLE_SKETCH_TOP)
+  {
+    top = &sketch->top[sketch->tops];
+    top->value = str_alloc(value->length()+1);
+    sample_atomic_add(&sketch->tops, 1);
+  }
+
+  if (!top)
+  {
+    top = &sketch->top[0];
+    for (uint i = 1; i < sketch->tops; i++)
+    {
+      if (sketch->top[i].count < top->count)
+        top = &sketch->top[i];
+    }
+    if (count <= top->count)
+      top = NULL;
+  }
+
+  if (top)
+  {
+    if (top->hash != h || !top->count)
+    {
+      top->hash = h;
+      str_reset(top->value);
+      str_cat(top->value, value->ptr(), value->length());
+    }
+    top->count = MY_MAX(top->count, count);
+
+    uint64 floor = top->count;
+    for (uint i = 0; i < sketch->tops; i++)
+      floor = MY_MIN(floor, sketch->top[i].count);
+
+    sample_atomic_store(&sketch->floor, sketch->tops == SAMPLE_SKETCH_TOP ? floor: 0);
+  }
+
+  pthread_mutex_unlock(&sketch->mutex);
+}
+
+// Lower or raise a double kept as bits in an atomic; most values change
+// neither, and cost one load
+static void sketch_extreme(uint64 *extreme, double x, bool lower)
+{
+  uint64 old = sample_atomic_load(extreme);
+
+  while (lower ? x < sketch_double(old): x > sketch_double(old))
+  {
+    if (sample_atomic_cas(extreme, old, sketch_bits(x)))
+      return;
+    old = sample_atomic_load(extreme);
+  }
+}
+
+// Quantiles: log-spaced buckets of constant relative width, so any
+// quantile is placed within 1% of its value
+static void sketch_value(sketch_t *sketch, double x)
+{
+  if (x != x)
+  {
+    sample_atomic_add(&sketch->zero, 1);
+    return;
+  }
+
+  sketch_extreme(&sketch->min, x, TRUE);
+  sketch_extreme(&sketch->max, x, FALSE);
+
+  if (x == 0)
+  {
+    sample_atomic_add(&sketch->zero, 1);
+    return;
+  }
+
+  // The end buckets take whatever is out of range; quantiles landing
+  // there report the real extreme instead
+  int i = (int) ceil(log(fabs(x)) / log(SAMPLE_SKETCH_GAMMA)) + SAMPLE_SKETCH_OFFSET;
+  i = MY_MIN(MY_MAX(i, 0), SAMPLE_SKETCH_BUCKETS-1);
+
+  sample_atomic_add(x > 0 ? &sketch->pos[i]: &sketch->neg[i], 1);
+}
+
+static double sketch_bucket_value(int i)
+{
+  double upper = pow(SAMPLE_SKETCH_GAMMA, i - SAMPLE_SKETCH_OFFSET);
+  return 2 * upper / (1 + SAMPLE_SKETCH_GAMMA);
+}
+
+static double sketch_quantile(sketch_t *sketch, double q, uint64 total)
+{
+  uint64 rank = (uint64) (q * (total - 1)), seen = 0;
+  double min = sketch_double(sample_atomic_load(&sketch->min));
+  double max = sketch_double(sample_atomic_load(&sketch->max));
+  double x = max;
+
+  for (int i = SAMPLE_SKETCH_BUCKETS-1; i >= 0; i--)
+  {
+    if ((seen += sample_atomic_load(&sketch->neg[i])) > rank)
+    {
+      x = i == SAMPLE_SKETCH_BUCKETS-1 ? min: -sketch_bucket_value(i);
+      goto found;
+    }
+  }
+
+  if ((seen += sample_atomic_load(&sketch->zero)) > rank)
+  {
+    x = 0;
+    goto found;
+  }
+
+  for (int i = 0; i < SAMPLE_SKETCH_BUCKETS; i++)
+  {
+    if ((seen += sample_atomic_load(&sketch->pos[i])) > rank)
+    {
+      x = i == SAMPLE_SKETCH_BUCKETS-1 ? max: sketch_bucket_value(i);
+      goto found;
+    }
+  }
+
+found:
+  // A bucket's midpoint may lie past the values actually seen
+  return MY_MIN(MY_MAX(x, min), max);
+}
+
+static uint64 sketch_values(sketch_t *sketch)
+{
+  uint64 total = sample_atomic_load(&sketch->zero);
+
+  for (int i = 0; i < SAMPLE_SKETCH_BUCKETS; i++)
+    total += sample_atomic_load(&sketch->neg[i]) + sample_atomic_load(&sketch->pos[i]);
+
+  return total;
+}
+
+// Decide once per table how each column is stored: a null bitmap, then one
+// 8 byte slot per column at a constant offset, then variable length data.
+// Integer slots hold the value; string slots hold a uint32 offset and
+// length into the variable area. Dictionary slots are string slots that
+// may instead hold a code and SAMPLE_CODED. Temporal, floating point and
+// decimal columns keep their packed field image: in the slot when it fits,
+// otherwise in extra fixed space after the slots. Columns are grouped by
+// type so encoding and decoding are a loop per type rather than a switch
+// per field.
+static plan_t* plan_alloc(TABLE_SHARE *share)
+{
+  plan_t *plan = (plan_t*) sample_alloc(sizeof(plan_t));
+
+  plan->fields = share->fields;
+  plan->nulls  = ALIGN_SIZE((share->fields + 7) / 8);
+  plan->fixed  = plan->nulls + share->fields * sizeof(int64);
+
+  uchar *types = (uchar*) sample_alloc(share->fields + 1);
+
+  for (uint col = 0; col < share->fields; col++)
+  {
+    Field *field = share->field[col];
+    types[col] = field->result_type() == INT_RESULT ? SAMPLE_INT64
+      : field->cmp_type() == STRING_RESULT ? SAMPLE_DICTIONARY
+      : field->cmp_type() == TIME_RESULT
+        || field->cmp_type() == REAL_RESULT
+        || field->cmp_type() == DECIMAL_RESULT ? SAMPLE_PACKED: SAMPLE_STRING;
+    plan->counts[types[col]]++;
+  }
+
+  for (uint type = 0; type < SAMPLE_TYPES; type++)
+  {
+    plan->columns[type] = (column_t*) sample_alloc(sizeof(column_t) * (plan->counts[type] + 1));
+    plan->counts[type] = 0;
+  }
+
+  for (uint col = 0; col < share->fields; col++)
+  {
+    Field *field = share->field[col];
+    column_t *column = &plan->columns[types[col]][plan->counts[types[col]]++];
+
+    column->field  = col;
+    column->offset = plan->nulls + col * sizeof(int64);
+    column->is_unsigned = (field->flags & UNSIGNED_FLAG) != 0;
+    column->is_weight = types[col] == SAMPLE_INT64 && field->option_struct->weight;
+
+    if (types[col] == SAMPLE_PACKED)
+    {
+      column->length = field->pack_length();
+
+      if (column->length > sizeof(int64))
+      {
+        column->offset = plan->fixed;
+        plan->fixed += column->length;
+      }
+    }
+
+    if (types[col] == SAMPLE_DICTIONARY)
+      column->dict = dict_alloc(&plan->dictionary);
+  }
+
+  sample_free(types);
+  return plan;
+}
+
+static void plan_free(plan_t *plan)
+{
+  for (uint i = 0; i < plan->counts[SAMPLE_DICTIONARY]; i++)
+    dict_free(plan->columns[SAMPLE_DICTIONARY][i].dict);
+
+  for (uint type = 0; type < SAMPLE_TYPES; type++)
+    sample_free(plan->columns[type]);
+  sample_free(plan);
+}
+
+// Index of the named column, or -1
+static int plan_field(TABLE_SHARE *share, const char *name)
+{
+  for (uint col = 0; name && col < share->fields; col++)
+  {
+    if (!my_strcasecmp(system_charset_info, share->field[col]->field_name, name))
+      return col;
+  }
+  return -1;
+}
+
+static bool plan_is_null(const uchar *row, uint col)
+{
+  return row[col / 8] & (1 << (col % 8));
+}
+
+static void plan_set_null(uchar *row, uint col)
+{
+  row[col / 8] |= 1 << (col % 8);
+}
+
+static int flushed_cmp(const void *a, const void *b)
+{
+  uint64 x = ((const flushed_t*)a)->id, y = ((const flushed_t*)b)->id;
+  return x < y ? -1: x > y;
+}
+
+// Bytes of a slab already in the file, from the last write
+static size_t flush_done(flush_t *flush, uint64 id)
+{
+  flushed_t key = { id, 0 };
+  flushed_t *found = (flushed_t*) bsearch(&key, flush->slabs, flush->count, sizeof(flushed_t), flushed_cmp);
+  return found ? found->length: 0;
+}
+
+// Load <name>.sample into a new table that is still loading. Runs of rows become
+// slabs again. A torn or corrupt tail, from a crash mid-write, is cut off
+// and everything before it is kept.
+static void sample_table_restore(SampleTable *table)
+{
+  flush_t *flush = table->flush = (flush_t*) sample_alloc(sizeof(flush_t));
+  plan_t *plan = table->plan;
+  arena_t *arena = table->rows;
+
+  flush->values = (uint32*) sample_alloc(sizeof(uint32) * (plan->counts[SAMPLE_DICTIONARY] + 1));
+
+  char fname[FN_REFLEN];
+  sample_file_name(fname, sizeof(fname), table->name, "");
+
+  int fd = open(fname, O_RDWR);
+  if (fd < 0)
+    return;
+
+  uint64 size = 0, offset = 0, next = 0, rows = 0, bytes = 0;
+  uchar *map = file_map(fd, &size);
+
+  if (!map)
+  {
+    close(fd);
+    return;
+  }
+
+  record_t record;
+  const uchar *buf;
+  slab_t *slab = NULL;
+
+  while ((buf = record_next(map, size, &next, &record)))
+  {
+    if (record.type == SAMPLE_RECORD_VALUE)
+    {
+      if (record.a >= plan->counts[SAMPLE_DICTIONARY])
+        break;
+
+      // Codes are handed out in order, so replaying values in code order
+      // gives every one its old code back
+      dict_t *dict = plan->columns[SAMPLE_DICTIONARY][record.a].dict;
+      if (dict_code(dict, buf, record.length) != record.b)
+        break;
+
+      flush->values[record.a] = dict->count;
+    }
+    else
+    if (record.type == SAMPLE_RECORD_ROWS)
+    {
+      // A filling slab is appended a little every second; pack records
+      // of one time bucket back into full slabs, not one slab apiece
+      if (!slab || slab->epoch != record.b || slab->length + record.length > slab->limit)
+      {
+        slab = arena_spare(arena, record.length);
+        slab->epoch = record.b;
+        arena_push(arena, slab);
+
+        flush->slabs = (flushed_t*) sample_realloc(flush->slabs, sizeof(flushed_t) * (flush->count + 1));
+        flush->slabs[flush->count].id = slab->id;
+        flush->count++;
+      }
+
+      memcpy(slab->buffer + slab->length, buf, record.length);
+
+      slab->length += record.length;
+      slab->rows   += record.a;
+      slab->settled_rows  = slab->rows;
+      slab->settled_bytes = slab->length;
+
+      flush->slabs[flush->count-1].length = slab->length;
+
+      rows  += record.a;
+      bytes += record.length;
+    }
+    else
+    {
+      break;
+    }
+
+    offset = next;
+  }
+
+  munmap(map, size);
+
+  if (offset < size)
+  {
+    sample_note("%s: dropped %llu bytes of torn or corrupt records", fname, size - offset);
+    if (ftruncate(fd, offset) != 0)
+      sample_error("%s: ftruncate failed %d", fname, errno);
+  }
+  close(fd);
+
+  // Slab ids were handed out in increasing order
+  flush->bytes = offset;
+
+  sample_atomic_add(&arena->shards[0].rows, rows);
+  sample_atomic_add(&arena->shards[0].bytes, bytes);
+  sample_atomic_add(&sample_rows_stored, rows);
+  sample_atomic_add(&sample_memory_used, bytes);
+
+  sample_note("%s: restored %llu rows", fname, rows);
+}
+
+// A SAMPLE_DURABLE table keeps what spilled before a restart, less any
+// torn tail. Otherwise the file is stale and goes.
+static void sample_spill_open(SampleTable *table, uint64 limit)
+{
+  spill_t *spill = table->spill = (spill_t*) sample_alloc(sizeof(spill_t));
+  spill->limit = limit;
+
+  char fname[FN_REFLEN];
+  sample_file_name(fname, sizeof(fname), table->name, ".spill");
+
+  if (!table->flush)
+  {
+    remove(fname);
+    return;
+  }
+
+  int fd = open(fname, O_RDWR);
+  if (fd < 0)
+    return;
+
+  uint64 size = 0, offset = 0;
+  uchar *map = file_map(fd, &size);
+
+  if (map)
+  {
+    record_t record;
+    while (record_next(map, size, &offset, &record))
+      spill->rows += record.a;
+
+    munmap(map, size);
+  }
+
+  if (offset < size && ftruncate(fd, offset) != 0)
+    sample_error("%s: ftruncate failed %d", fname, errno);
+
+  close(fd);
+
+  spill->bytes = offset;
+  sample_atomic_add(&sample_spill_bytes, offset);
+}
+
+// Append whatever was stored since the last write to <name>.sample: new
+// dictionary values first, then new rows from each slab. After a drain,
+// or once expiry has left the file mostly dead rows, write everything
+// live to a new file and rename it over the old. Runs on the flusher
+// thread only; INSERT never waits on this.
+static void sample_table_flush(SampleTable *table)
+{
+  flush_t *flush = table->flush;
+  plan_t *plan = table->plan;
+
+  // Serializes with rename_table() changing the name under us, and with
+  // TRUNCATE resetting the dictionaries the snapshot's codes refer to
+  pthread_mutex_lock(&table->flush_mutex);
+
+  uint64 drains = sample_atomic_load(&table->drains);
+  cursor_t *cursor = arena_snapshot(table->rows);
+
+  uint64 live = 0;
+  bool changed = FALSE;
+
+  for (uint64 i = 0; i < cursor->count; i++)
+  {
+    live += cursor->lengths[i];
+    changed |= cursor->lengths[i] > flush_done(flush, cursor->slabs[i]->id);
+  }
+
+  bool rewrite = flush->failed || drains != flush->drains
+    || flush->bytes > live * 2 + SAMPLE_SLAB_SIZE;
+
+  if (!changed && !rewrite)
+  {
+    pthread_mutex_unlock(&table->flush_mutex);
+    cursor_free(cursor, table->rows);
+    return;
+  }
+
+  char fname[FN_REFLEN], tname[FN_REFLEN];
+  sample_file_name(fname, sizeof(fname), table->name, "");
+  sample_file_name(tname, sizeof(tname), table->name, ".tmp");
+
+  int fd = open(rewrite ? tname: fname, O_WRONLY | O_CREAT | (rewrite ? O_TRUNC: O_APPEND), 0660);
+  bool ok = fd >= 0;
+  uint64 bytes = rewrite ? 0: flush->bytes;
+
+  if (rewrite)
+    memset(flush->values, 0, sizeof(uint32) * plan->counts[SAMPLE_DICTIONARY]);
+
+  // Codes in the snapshot were all published before the rows using them
+  for (uint i = 0; ok && i < plan->counts[SAMPLE_DICTIONARY]; i++)
+  {
+    dict_t *dict = plan->columns[SAMPLE_DICTIONARY][i].dict;
+    uint32 count = sample_atomic_load(&dict->count);
+
+    for (uint32 code = flush->values[i]; ok && code < count; code++)
+      ok = record_write(fd, SAMPLE_RECORD_VALUE, i, code, dict->values[code], dict->lengths[code], &bytes);
+
+    flush->values[i] = count;
+  }
+
+  flushed_t *slabs = (flushed_t*) sample_alloc(sizeof(flushed_t) * (cursor->count + 1));
+
+  for (uint64 i = 0; ok && i < cursor->count; i++)
+  {
+    slab_t *slab = cursor->slabs[i];
+    size_t from = rewrite ? 0: flush_done(flush, slab->id), to = cursor->lengths[i];
+
+    slabs[i].id = slab->id;
+    slabs[i].length = to;
+
+    if (from >= to)
+      continue;
+
+    cursor->index = i;
+    uchar *buf = cursor_buffer(cursor);
+
+    uint64 rows = 0;
+    for (size_t offset = from; offset < to; offset += slab_row_width(*((uint*)(buf + offset))))
+      rows++;
+
+    ok = record_write(fd, SAMPLE_RECORD_ROWS, rows, slab->epoch, buf + from, to - from, &bytes);
+  }
+
+  if (ok && fdatasync(fd) != 0)
+    ok = FALSE;
+
+  if (fd >= 0)
+    close(fd);
+
+  if (ok && rewrite && rename(tname, fname) != 0)
+    ok = FALSE;
+
+  if (ok)
+  {
+    qsort(slabs, cursor->count, sizeof(flushed_t), flushed_cmp);
+    sample_free(flush->slabs);
+    flush->slabs  = slabs;
+    flush->count  = cursor->count;
+    flush->bytes  = bytes;
+    flush->drains = drains;
+  }
+  else
+  {
+    sample_error("%s: write failed %d", rewrite ? tname: fname, errno);
+    sample_free(slabs);
+  }
+
+  // A partial append is cut off on restore; start clean next time
+  flush->failed = !ok;
+
+  pthread_mutex_unlock(&table->flush_mutex);
+
+  cursor_free(cursor, table->rows);
+}
+
+static const char* sample_table_key(void *table)
+{
+  return ((SampleTable*)table)->name;
+}
+
+// Caller holds sample_tables_lock, read or write
+static SampleTable* sample_table_find(const char *name)
+{
+  return (SampleTable*) hash_find(sample_tables, name);
+}
+
+// Table options that may change under an open table. Zero means follow
+// the global, read afresh for every row.
+static void sample_table_options(SampleTable *table, TABLE_SHARE *share)
+{
+  ha_table_option_struct *options = share->option_struct;
+
+  sample_atomic_store(&table->rate, (uint) options->rate);
+  sample_atomic_store(&table->limit, (uint) options->limit);
+  sample_atomic_store(&table->target, (uint) options->target);
+  sample_atomic_store(&table->hash, plan_field(share, options->hash));
+  sample_atomic_store(&table->rows->compress, options->compression);
+}
+
+static uint sample_table_rate(SampleTable *table)
+{
+  uint rate = sample_atomic_load(&table->target) ? sample_atomic_load(&table->adaptive): 0;
+
+  if (!rate)
+    rate = sample_atomic_load(&table->rate);
+
+  return rate ? rate: sample_atomic_load(&sample_rate);
+}
+
+// With SAMPLE_TARGET set, once a second at most, pick the rate that would
+// have stored the target rows per second over the last period. Only
+// sampled rows get here, so a quiet table is retuned when its next
+// sampled row arrives.
+static void sample_table_tune(SampleTable *table)
+{
+  uint target = sample_atomic_load(&table->target);
+  if (!target)
+    return;
+
+  uint64 now = time(NULL);
+  uint64 period = sample_atomic_load(&table->period);
+
+  if (now <= period || !sample_atomic_cas(&table->period, period, now))
+    return;
+
+  uint64 incoming = sample_atomic_swap(&table->seen, (uint64)0) / (now - period);
+  uint64 rate = incoming / target;
+
+  sample_atomic_store(&table->adaptive, (uint) MY_MIN(MY_MAX(rate, 1), UINT_MAX32));
+}
+
+static uint sample_table_limit(SampleTable *table)
+{
+  uint limit = sample_atomic_load(&table->limit);
+  return limit ? limit: sample_atomic_load(&sample_limit);
+}
+
+// Bump a per-table counter and its global total
+static void sample_table_count(uint64 *counter, ulonglong *total, uint64 n)
+{
+  sample_atomic_add(counter, n);
+  sample_atomic_add(total, n);
+}
+
+// Rows and bytes held right now
+static void sample_table_usage(SampleTable *table, uint64 *rows, uint64 *bytes)
+{
+  arena_usage(table->rows, rows, bytes);
+
+  *bytes += sample_atomic_load(&table->plan->dictionary);
+
+  if (table->spill)
+  {
+    *rows  += sample_atomic_load(&table->spill->rows);
+    *bytes += sample_atomic_load(&table->spill->bytes);
+  }
+
+  if (table->reservoirs)
+  {
+    pthread_mutex_lock(&table->mutex);
+    for (uint i = 0; i < table->strata; i++)
+    {
+      *rows  += table->reservoirs[i]->filled;
+      *bytes += table->reservoirs[i]->bytes;
+    }
+    pthread_mutex_unlock(&table->mutex);
+  }
+}
+
+// Everything of a newly filed table but its name and locks, restoring
+// its files, then let in anyone waiting for it
+static void sample_table_build(SampleTable *table, TABLE_SHARE *share)
+{
+  table->plan  = plan_alloc(share);
+  table->rows  = arena_alloc();
+  table->period = time(NULL);
+
+  sample_table_options(table, share);
+
+  ha_table_option_struct *options = share->option_struct;
+
+  table->key = plan_field(share, options->key);
+
+  for (uint col = 0; col < share->fields; col++)
+    table->sketched += share->field[col]->option_struct->sketch;
+
+  if (table->sketched)
+  {
+    table->sketches = (sketch_t*) sample_alloc(sizeof(sketch_t) * table->sketched);
+
+    for (uint col = 0, i = 0; col < share->fields; col++)
+    {
+      if (share->field[col]->option_struct->sketch)
+        sketch_init(&table->sketches[i++], share->field[col], col);
+    }
+  }
+
+  // Capacity is fixed for as long as the table stays open. A keyed
+  // table splits the row limit into strata of SAMPLE_QUOTA rows, or
+  // into SAMPLE_STRATA larger ones.
+  if (options->mode == SAMPLE_MODE_RESERVOIR || table->key >= 0)
+  {
+    uint limit = sample_table_limit(table);
+    uint quota = table->key >= 0 ? MY_MIN((uint) options->quota, limit): limit;
+
+    table->strata = MY_MIN(MY_MAX(limit / quota, 1), SAMPLE_STRATA);
+    quota = MY_MAX(quota, limit / table->strata);
+    table->reservoirs = (reservoir_t**) sample_alloc(sizeof(reservoir_t*) * table->strata);
+
+    for (uint i = 0; i < table->strata; i++)
+      table->reservoirs[i] = reservoir_alloc(quota);
+  }
+
+  if (options->window && !table->reservoirs)
+  {
+    table->rows->window = options->window;
+    table->rows->width  = MY_MAX(options->window / SAMPLE_WINDOW_BUCKETS, 1);
+  }
+
+  // Append mode only; a reservoir is rewritten in place as it goes
+  if (options->durable && !table->reservoirs)
+    sample_table_restore(table);
+
+  if (options->spill && !table->reservoirs)
+    sample_spill_open(table, options->spill * 1024 * 1024);
+
+  thr_lock_init(&table->mysql_lock);
+
+  pthread_mutex_lock(&table->mutex);
+  sample_atomic_store(&table->loading, FALSE);
+  pthread_cond_broadcast(&table->users_cond);
+  pthread_mutex_unlock(&table->mutex);
+}
+
+// Block until whoever filed the table has finished building it
+static void sample_table_ready(SampleTable *table)
+{
+  pthread_mutex_lock(&table->mutex);
+  while (sample_atomic_load(&table->loading))
+    pthread_cond_wait(&table->users_cond, &table->mutex);
+  pthread_mutex_unlock(&table->mutex);
+}
+
+// The first open files the table as loading and builds it outside
+// sample_tables_lock, so restoring one table's files never holds up
+// opening the others. Later opens of the same table wait for it.
+static SampleTable* sample_table_open(const char *name, TABLE_SHARE *share)
+{
+  pthread_rwlock_rdlock(&sample_tables_lock);
+
+  SampleTable *table = sample_table_find(name);
+  if (table)
+    sample_atomic_add(&table->users, 1);
+
+  pthread_rwlock_unlock(&sample_tables_lock);
+
+  if (!table)
+  {
+    pthread_rwlock_wrlock(&sample_tables_lock);
+
+    // Someone else may have got here first
+    if ((table = sample_table_find(name)))
+    {
+      sample_atomic_add(&table->users, 1);
+      pthread_rwlock_unlock(&sample_tables_lock);
+    }
+    else
+    {
+      table = (SampleTable*) sample_alloc(sizeof(SampleTable));
+
+      table->name = (char*) sample_alloc(strlen(name)+1);
+      strcpy(table->name, name);
+
+      table->loading = TRUE;
+      table->users = 1;
+
+      pthread_mutex_init(&table->mutex, NULL);
+      pthread_mutex_init(&table->flush_mutex, NULL);
+      pthread_cond_init(&table->users_cond, NULL);
+
+      hash_insert(sample_tables, table);
+
+      pthread_rwlock_unlock(&sample_tables_lock);
+
+      sample_table_build(table, share);
+      return table;
+    }
+  }
+
+  sample_table_ready(table);
+
+  // Reopened after an in-place ALTER, perhaps
+  sample_table_options(table, share);
+  return table;
+}
+
+// Decrement under SampleTable::mutex so sample_table_wait() can't miss it
+static void sample_table_close(SampleTable *table)
+{
+  pthread_mutex_lock(&table->mutex);
+  if (sample_atomic_sub(&table->users, 1) <= 2)
+    pthread_cond_broadcast(&table->users_cond);
+  pthread_mutex_unlock(&table->mutex);
+}
+
+// Block until the caller's reference is the only one left
+static void sample_table_wait(SampleTable *table)
+{
+  pthread_mutex_lock(&table->mutex);
+  while (sample_atomic_load(&table->users) > 1)
+    pthread_cond_wait(&table->users_cond, &table->mutex);
+  pthread_mutex_unlock(&table->mutex);
+}
+
+static void sample_table_drop(SampleTable *table, bool hard)
+{
+  if (hard)
+    sample_file_remove(table->name);
+
+  if (table->spill)
+  {
+    sample_atomic_sub(&sample_spill_bytes, table->spill->bytes);
+    sample_free(table->spill);
+  }
+
+  if (table->flush)
+  {
+    sample_free(table->flush->slabs);
+    sample_free(table->flush->values);
+    sample_free(table->flush);
+  }
+
+  pthread_mutex_destroy(&table->flush_mutex);
+  pthread_mutex_destroy(&table->mutex);
+  pthread_cond_destroy(&table->users_cond);
+
+  // Off the global gauges first, like a drain; no writer is left
+  arena_retire(table->rows, table->rows->head);
+  arena_free(table->rows);
+  plan_free(table->plan);
+
+  if (table->reservoirs)
+  {
+    for (uint i = 0; i < table->strata; i++)
+      reservoir_free(table->reservoirs[i]);
+    sample_free(table->reservoirs);
+  }
+
+  for (uint i = 0; i < table->sketched; i++)
+    sketch_free(&table->sketches[i]);
+  sample_free(table->sketches);
+
+  thr_lock_delete(&table->mysql_lock);
+  sample_free(table->name);
+  sample_free(table);
+}
+
+// Have the flusher spill now, rather than on its next round
+static void sample_spill_wake(SampleTable *table)
+{
+  if (!table->spill || !sample_atomic_cas(&table->spill->wanted, 0, 1))
+    return;
+
+  pthread_mutex_lock(&sample_flusher_mutex);
+  sample_flusher_spill = TRUE;
+  pthread_cond_signal(&sample_flusher_cond);
+  pthread_mutex_unlock(&sample_flusher_mutex);
+}
+
+// Move the oldest whole slabs of a SAMPLE_SPILL table to <name>.spill
+// until it is back under half its memory and row limits. Slabs go only
+// when nothing else holds them, and are unlinked under arena->mutex but
+// written outside it, so an INSERT rolling to a new slab never waits on
+// the disk. A SELECT in between does not see the rows in flight.
+static void sample_table_spill(SampleTable *table)
+{
+  spill_t *spill = table->spill;
+  arena_t *arena = table->rows;
+
+  sample_atomic_store(&spill->wanted, 0);
+
+  uint64 memory_limit = sample_atomic_load(&sample_memory_limit) / 2;
+  uint64 row_limit = sample_table_limit(table) / 2;
+
+  uint64 bytes, rows;
+  arena_usage(arena, &rows, &bytes);
+
+  uint64 room  = spill->limit - MY_MIN(spill->limit, sample_atomic_load(&spill->bytes));
+
+  if (bytes <= memory_limit && rows <= row_limit)
+    return;
+
+  slab_t *slabs = NULL;
+
+  pthread_mutex_lock(&arena->mutex);
+
+  slab_t *head = sample_atomic_load(&arena->head);
+
+  uint64 count = 0;
+  for (slab_t *slab = head; slab; slab = slab->next)
+    count++;
+
+  slab_t **stack = (slab_t**) sample_alloc(sizeof(slab_t*) * MY_MAX(count, 1));
+
+  // Snapshots take references under the mutex too, so a slab only the
+  // arena stack holds stays that way until it is unlinked
+  uint64 idle = 0;
+  for (slab_t *slab = head; slab && idle < count; slab = slab->next)
+  {
+    if (sample_atomic_load(&slab->refs) == 1 && !sample_atomic_load(&slab->writing))
+      stack[idle++] = slab;
+  }
+
+  // Oldest first, from the bottom of the stack
+  for (uint64 i = idle; i-- > 0 && (bytes > memory_limit || rows > row_limit); )
+  {
+    slab_t *slab = stack[i];
+    size_t length = slab->raw ? slab->raw: slab->length;
+
+    if (sizeof(record_t) + length > room)
+      break;
+
+    room -= sizeof(record_t) + length;
+
+    arena_replace(arena, slab, slab->next);
+    sample_atomic_store(&slab->detached, 1);
+
+    bytes -= MY_MIN(bytes, slab->length);
+    rows  -= MY_MIN(rows, slab->rows);
+
+    slab->next = slabs;
+    slabs = slab;
+  }
+
+  pthread_mutex_unlock(&arena->mutex);
+
+  sample_free(stack);
+
+  if (!slabs)
+    return;
+
+  arena_retire(arena, slabs);
+
+  cursor_t *cursor = cursor_chain(slabs);
+
+  pthread_mutex_lock(&table->flush_mutex);
+
+  char fname[FN_REFLEN];
+  sample_file_name(fname, sizeof(fname), table->name, ".spill");
+
+  int fd = open(fname, O_WRONLY | O_CREAT | O_APPEND, 0660);
+  bool ok = fd >= 0;
+  uint64 written = 0, spilled = 0, lost = 0;
+
+  for (uint64 i = 0; i < cursor->count; i++)
+  {
+    slab_t *slab = cursor->slabs[i];
+    cursor->index = i;
+
+    if (ok && (ok = record_write(fd, SAMPLE_RECORD_ROWS, slab->rows, slab->epoch, cursor_buffer(cursor), cursor->lengths[i], &written)))
+      spilled += slab->rows;
+    else
+      lost += slab->rows;
+  }
+
+  // Durable tables sync like their .sample file does
+  if (ok && table->flush && fdatasync(fd) != 0)
+    ok = FALSE;
+
+  if (!ok)
+  {
+    sample_error("%s: write failed %d", fname, errno);
+
+    // Cut off a partial record, so later appends stay readable
+    if (fd >= 0 && ftruncate(fd, spill->bytes + written) != 0)
+      sample_error("%s: ftruncate failed %d", fname, errno);
+  }
+
+  if (fd >= 0)
+    close(fd);
+
+  sample_atomic_add(&spill->bytes, written);
+  sample_atomic_add(&spill->rows, spilled);
+
+  pthread_mutex_unlock(&table->flush_mutex);
+
+  // The .sample file no longer holds these rows in memory terms; rewrite it
+  sample_atomic_add(&table->drains, 1);
+
+  sample_atomic_add(&sample_spill_bytes, written);
+  sample_atomic_add(&sample_rows_spilled, spilled);
+  sample_table_count(&table->rows_limited, &sample_rows_dropped_limit, lost);
+
+  cursor_free(cursor, arena);
+}
+
+// Follow a cursor's slabs with the rows in <name>.spill. Taking them
+// unlinks the file, which stays readable through the mapping until the
+// cursor is freed, and the next spill starts a new one.
+static void cursor_spill(cursor_t *cursor, SampleTable *table, bool take)
+{
+  spill_t *spill = table->spill;
+
+  pthread_mutex_lock(&table->flush_mutex);
+
+  char fname[FN_REFLEN];
+  sample_file_name(fname, sizeof(fname), table->name, ".spill");
+
+  int fd = open(fname, O_RDONLY);
+  if (fd >= 0)
+  {
+    if ((cursor->map = file_map(fd, &cursor->mapped)))
+      madvise(cursor->map, cursor->mapped, MADV_SEQUENTIAL);
+    close(fd);
+  }
+
+  if (take)
+  {
+    unlink(fname);
+    sample_atomic_sub(&sample_spill_bytes, spill->bytes);
+    sample_atomic_store(&spill->bytes, 0);
+    sample_atomic_store(&spill->rows, 0);
+  }
+
+  pthread_mutex_unlock(&table->flush_mutex);
+
+  cursor->expired = sample_atomic_load(&table->rows->expired);
+}
+
+// Deflate the slabs of a SAMPLE_COMPRESSION table that only the arena
+// stack still holds. Each is claimed with a reference under arena->mutex,
+// like the owner's it replaces, so neither a spill nor another round
+// takes it meanwhile.
+static void sample_table_compress(SampleTable *table)
+{
+  arena_t *arena = table->rows;
+
+  if (!sample_atomic_load(&arena->compress))
+    return;
+
+  list_t *slabs = list_alloc();
+
+  pthread_mutex_lock(&arena->mutex);
+
+  for (slab_t *slab = sample_atomic_load(&arena->head); slab; slab = slab->next)
+  {
+    if (sample_atomic_load(&slab->refs) == 1 && !sample_atomic_load(&slab->writing)
+      && !slab->raw && !sample_atomic_load(&slab->plain))
+    {
+      sample_atomic_add(&slab->refs, 1);
+      list_insert_head(slabs, slab);
+    }
+  }
+
+  pthread_mutex_unlock(&arena->mutex);
+
+  slab_t *slab;
+  while ((slab = (slab_t*) list_remove_head(slabs)))
+    arena_compress(arena, slab);
+
+  list_free(slabs);
+}
+
+// Deflate every SAMPLE_COMPRESSION table's full slabs, then unless only
+// asked to deflate, write every SAMPLE_DURABLE table and spill every
+// SAMPLE_SPILL table that needs it. Each is pinned so DROP and RENAME wait.
+static void sample_flush_all(bool all)
+{
+  pthread_rwlock_rdlock(&sample_tables_lock);
+
+  list_t *tables = list_alloc();
+
+  for (uint64 b = 0; b < sample_tables->width; b++)
+  {
+    for (node_t *node = sample_tables->buckets[b]; node; node = node->next)
+    {
+      SampleTable *table = (SampleTable*) node->payload;
+      bool wanted = sample_atomic_load(&table->rows->compress) || (all && (table->flush || table->spill));
+
+      if (wanted && !table->dropping && !sample_atomic_load(&table->loading))
+      {
+        sample_atomic_add(&table->users, 1);
+        list_insert_head(tables, table);
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&sample_tables_lock);
+
+  SampleTable *table;
+  while ((table = (SampleTable*) list_remove_head(tables)))
+  {
+    sample_table_compress(table);
+    if (all && table->spill)
+      sample_table_spill(table);
+    if (all && table->flush)
+      sample_table_flush(table);
+    sample_table_close(table);
+  }
+
+  list_free(tables);
+}
+
+// Free the cursors finished statements handed over, slabs and spill
+// mappings in bulk, then unpin their tables
+static void sample_reclaim_all()
+{
+  pthread_mutex_lock(&sample_flusher_mutex);
+  list_t *reclaim = sample_reclaim;
+  sample_reclaim = list_alloc();
+  pthread_mutex_unlock(&sample_flusher_mutex);
+
+  trash_t *trash;
+  while ((trash = (trash_t*) list_remove_head(reclaim)))
+  {
+    cursor_t *cursor;
+    while ((cursor = (cursor_t*) list_remove_head(trash->cursors)))
+      cursor_free(cursor, trash->table->rows);
+
+    list_free(trash->cursors);
+    sample_table_close(trash->table);
+    sample_free(trash);
+  }
+
+  list_free(reclaim);
+}
+
+// Reclaim as soon as there is trash, and deflate as soon as a slab
+// fills; write and spill once a second, or as soon as a table asks to spill
+static void* sample_flusher_main(void *arg)
+{
+  time_t due = time(NULL) + SAMPLE_FLUSH_INTERVAL;
+
+  pthread_mutex_lock(&sample_flusher_mutex);
+
+  while (!sample_flusher_stop)
+  {
+    if (list_is_empty(sample_reclaim) && !sample_flusher_spill
+      && !sample_atomic_load(&sample_flusher_compress) && time(NULL) < due)
+    {
+      struct timespec ts = { due, 0 };
+      pthread_cond_timedwait(&sample_flusher_cond, &sample_flusher_mutex, &ts);
+      continue;
+    }
+
+    bool flush = sample_flusher_spill || time(NULL) >= due;
+    bool compress = sample_atomic_swap(&sample_flusher_compress, 0);
+    sample_flusher_spill = FALSE;
+
+    pthread_mutex_unlock(&sample_flusher_mutex);
+
+    sample_reclaim_all();
+
+    if (flush)
+    {
+      sample_flush_all(TRUE);
+      due = time(NULL) + SAMPLE_FLUSH_INTERVAL;
+    }
+    else
+    if (compress)
+    {
+      sample_flush_all(FALSE);
+    }
+
+    pthread_mutex_lock(&sample_flusher_mutex);
+  }
+
+  pthread_mutex_unlock(&sample_flusher_mutex);
+  return NULL;
+}
+
+// Take everything stored so far
+static cursor_t* sample_table_drain(SampleTable *table)
+{
+  slab_t *slabs = NULL;
+
+  // Readers already sharing the last drain carry on; no one new joins it
+  pthread_mutex_lock(&table->mutex);
+  table->scan = NULL;
+  pthread_mutex_unlock(&table->mutex);
+
+  arena_expire(table->rows);
+
+  if (table->reservoirs)
+  {
+    pthread_mutex_lock(&table->mutex);
+    for (uint i = 0; i < table->strata; i++)
+      slabs = reservoir_drain(table->reservoirs[i], table->rows, slabs);
+    pthread_mutex_unlock(&table->mutex);
+  }
+  else
+  {
+    slabs = arena_drain(table->rows);
+  }
+
+  // Once the rows are gone the .sample file is rewritten, not appended to
+  sample_atomic_add(&table->drains, 1);
+
+  cursor_t *cursor = cursor_chain(slabs);
+
+  if (table->spill)
+    cursor_spill(cursor, table, TRUE);
+
+  return cursor;
+}
+
+// Read everything stored so far and leave it in place. The reservoir is
+// small and mutable, so that is copied; append mode slabs are shared.
+// A consuming SELECT joins the last drain while another reader is still
+// busy with it and it has rows to hand out, so several connections
+// exporting at once split one drain between them and each decodes its
+// share on its own core. Otherwise it drains afresh and leaves that open
+// for others to join.
+// The table holds no reference on the drain it publishes; readers hold
+// them all, so the last one to go frees the drain on the background
+// thread along with the rest of its statement's trash.
+static cursor_t* sample_table_scan(SampleTable *table)
+{
+  cursor_t *cursor = NULL;
+
+  pthread_mutex_lock(&table->mutex);
+
+  cursor_t *scan = table->scan;
+  if (scan && !cursor_done(scan))
+  {
+    cursor = cursor_join(scan);
+    scan->active++;
+  }
+  else
+  {
+    table->scan = NULL;
+  }
+
+  pthread_mutex_unlock(&table->mutex);
+
+  if (cursor)
+    return cursor;
+
+  cursor_t *shared = sample_table_drain(table);
+  cursor = cursor_join(shared);
+  shared->active = 1;
+
+  pthread_mutex_lock(&table->mutex);
+  table->scan = shared;
+  pthread_mutex_unlock(&table->mutex);
+
+  return cursor;
+}
+
+// A reader is done with its share of a drain. Once nothing is left to
+// claim, or the last reader has left, the drain is closed to later
+// SELECTs, which would otherwise pick up rows a LIMIT left behind.
+static void sample_table_leave(SampleTable *table, cursor_t *cursor)
+{
+  cursor_t *shared = cursor->shared;
+
+  if (!shared)
+    return;
+
+  pthread_mutex_lock(&table->mutex);
+
+  if ((--shared->active == 0 || cursor_done(shared)) && table->scan == shared)
+    table->scan = NULL;
+
+  pthread_mutex_unlock(&table->mutex);
+}
+
+static cursor_t* sample_table_snapshot(SampleTable *table)
+{
+  if (table->reservoirs)
+  {
+    slab_t *slabs = NULL;
+
+    pthread_mutex_lock(&table->mutex);
+    for (uint i = 0; i < table->strata; i++)
+      slabs = reservoir_copy(table->reservoirs[i], table->rows, slabs);
+    pthread_mutex_unlock(&table->mutex);
+
+    return cursor_chain(slabs);
+  }
+
+  arena_expire(table->rows);
+
+  cursor_t *cursor = arena_snapshot(table->rows);
+
+  if (table->spill)
+    cursor_spill(cursor, table, FALSE);
+
+  return cursor;
+}
+
+// SHOW ENGINE SAMPLE STATUS: one line of counters per open table
+static bool sample_show_status(handlerton* hton, THD* thd, stat_print_fn* stat_print, enum ha_stat_type stat_type)
+{
+  str_t *str = str_alloc(100);
+  bool failed = FALSE;
+
+  pthread_rwlock_rdlock(&sample_tables_lock);
+
+  for (uint64 b = 0; !failed && b < sample_tables->width; b++)
+  {
+    for (node_t *node = sample_tables->buckets[b]; !failed && node; node = node->next)
+    {
+      SampleTable *table = (SampleTable*) node->payload;
+
+      if (sample_atomic_load(&table->loading))
+        continue;
+
+      uint64 rows, bytes;
+      sample_table_usage(table, &rows, &bytes);
+
+      str_reset(str);
+      str_print(str, "seen=%llu sampled=%llu inserted=%llu dropped_limit=%llu dropped_contention=%llu rows=%llu bytes=%llu",
+        sample_atomic_load(&table->rows_seen),
+        sample_atomic_load(&table->rows_sampled),
+        sample_atomic_load(&table->rows_inserted),
+        sample_atomic_load(&table->rows_limited),
+        sample_atomic_load(&table->rows_contended),
+        rows, bytes);
+
+      failed = stat_print(thd, STRING_WITH_LEN("SAMPLE"), table->name, strlen(table->name), str->buffer, str->length);
+    }
+  }
+
+  pthread_rwlock_unlock(&sample_tables_lock);
+
+  str_free(str);
+
+  return failed;
+}
+
+static int sample_init_func(void *p)
+{
+  sample_hton = (handlerton*)p;
+
+  sample_hton->state  = SHOW_OPTION_YES;
+  sample_hton->create = sample_create_handler;
+
+  sample_hton->flags
+  = HTON_TEMPORARY_NOT_SUPPORTED
+  | HTON_NO_PARTITION
+  | HTON_SUPPORT_LOG_TABLES;
+
+  sample_hton->table_options = sample_table_option_list;
+  sample_hton->field_options = sample_field_option_list;
+  sample_hton->show_status = sample_show_status;
+
+  sample_seed = 1;
+
+  pthread_rwlock_init(&sample_tables_lock, NULL);
+
+  sample_tables = hash_alloc(64, sample_table_key);
+
+  pthread_mutex_init(&sample_flusher_mutex, NULL);
+  pthread_cond_init(&sample_flusher_cond, NULL);
+  sample_flusher_stop = FALSE;
+  sample_flusher_spill = FALSE;
+  sample_flusher_compress = 0;
+  sample_reclaim = list_alloc();
+
+  if (pthread_create(&sample_flusher, NULL, sample_flusher_main, NULL))
+  {
+    sample_error("flusher thread failed %d", errno);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int sample_done_func(void *p)
+{
+  pthread_mutex_lock(&sample_flusher_mutex);
+  sample_flusher_stop = TRUE;
+  pthread_cond_signal(&sample_flusher_cond);
+  pthread_mutex_unlock(&sample_flusher_mutex);
+
+  pthread_join(sample_flusher, NULL);
+
+  // Clean shutdown: everything stored so far goes to disk
+  sample_reclaim_all();
+  sample_flush_all(TRUE);
+
+  list_free(sample_reclaim);
+  pthread_mutex_destroy(&sample_flusher_mutex);
+  pthread_cond_destroy(&sample_flusher_cond);
+
+  SampleTable *table;
+  while ((table = (SampleTable*) hash_any(sample_tables)))
+  {
+    hash_delete(sample_tables, table);
+    sample_table_drop(table, FALSE);
+  }
+  hash_free(sample_tables);
+
+  pthread_rwlock_destroy(&sample_tables_lock);
+
+  return 0;
+}
+
+static handler* sample_create_handler(handlerton *hton, TABLE_SHARE *table, MEM_ROOT *mem_root)
+{
+  return new (mem_root) ha_sample(hton, table);
+}
+
+ha_sample::ha_sample(handlerton *hton, TABLE_SHARE *table_arg)
+  :handler(hton, table_arg)
+{
+  sample_debug("%s", __func__);
+  sample_table = NULL;
+  sample_trash = NULL;
+  sample_strings = NULL;
+  sample_values  = NULL;
+  sample_codes   = NULL;
+  sample_cursor = NULL;
+  sample_owned = NULL;
+
+  rng_seed(&sample_rng, sample_atomic_add(&sample_seed, 1));
+  sample_skip = 0;
+  sample_seen = 0;
+  sample_sampled = 0;
+  sample_inserted = 0;
+  sample_shard = 0;
+  sample_weight = 1;
+}
+
+static const char *ha_sample_exts[] = {
+  NullS
+};
+
+const char **ha_sample::bas_ext() const
+{
+  sample_debug("%s", __func__);
+  return ha_sample_exts;
+}
+
+// Hand the cursors this statement finished with to the background thread,
+// which releases their slabs in bulk. The table stays pinned until then.
+void ha_sample::empty_trash()
+{
+  if (!sample_trash)
+    return;
+
+  if (list_is_empty(sample_trash))
+  {
+    list_free(sample_trash);
+    sample_trash = NULL;
+    return;
+  }
+
+  trash_t *trash = (trash_t*) sample_alloc(sizeof(trash_t));
+  trash->table   = sample_table;
+  trash->cursors = sample_trash;
+  sample_trash = NULL;
+
+  sample_atomic_add(&sample_table->users, 1);
+
+  pthread_mutex_lock(&sample_flusher_mutex);
+  list_insert_head(sample_reclaim, trash);
+  pthread_cond_signal(&sample_flusher_cond);
+  pthread_mutex_unlock(&sample_flusher_mutex);
+}
+
+void ha_sample::use_trash()
+{
+  if (!sample_trash)
+    sample_trash = list_alloc();
+}
+
+int ha_sample::open(const char *name, int mode, uint test_if_locked)
+{
+  sample_debug("%s %s", __func__, name);
+  reset();
+
+  sample_table = sample_table_open(name, table->s);
+  thr_lock_data_init(&sample_table->mysql_lock, &lock, NULL);
+
+  if (sample_table)
+  {
+    sample_weight = sample_table_rate(sample_table);
+    sample_skip = rng_skip(&sample_rng, sample_weight);
+
+    // Until it owns a slab
+    sample_shard = arena_shard();
+  }
+
+  return sample_table ? 0: -1;
+}
+
+int ha_sample::close(void)
+{
+  sample_debug("%s", __func__);
+
+  rnd_end();
+  count_flush();
+
+  if (sample_owned)
+  {
+    slab_release(sample_table->rows, sample_owned);
+    sample_owned = NULL;
+  }
+
+  empty_trash();
+
+  sample_table_close(sample_table);
+  sample_table = NULL;
+
+  delete [] sample_strings;
+  sample_strings = NULL;
+
+  sample_free(sample_values);
+  sample_values = NULL;
+
+  sample_free(sample_codes);
+  sample_codes = NULL;
+
+  return 0;
+}
+
+int ha_sample::record_store(SampleRow *row, uchar *buf)
+{
+  if (!row)
+    return HA_ERR_END_OF_FILE;
+
+  memset(buf, 0, table->s->null_bytes);
+  // Avoid asserts in ::store() for columns that are not going to be updated
+  my_bitmap_map *org_bitmap = dbug_tmp_use_all_columns(table, table->write_set);
+
+  plan_t *plan = sample_table->plan;
+  uchar  *buff = row->buffer;
+
+  for (uint i = 0; i < plan->counts[SAMPLE_INT64]; i++)
+  {
+    column_t *column = &plan->columns[SAMPLE_INT64][i];
+    Field *field = table->field[column->field];
+
+    if (plan_is_null(buff, column->field))
+    {
+      field->set_null();
+      continue;
+    }
+
+    int64 n;
+    memcpy(&n, buff + column->offset, sizeof(int64));
+    field->store(n, column->is_unsigned);
+  }
+
+  for (uint i = 0; i < plan->counts[SAMPLE_STRING]; i++)
+  {
+    column_t *column = &plan->columns[SAMPLE_STRING][i];
+    Field *field = table->field[column->field];
+
+    if (plan_is_null(buff, column->field))
+    {
+      field->set_null();
+      continue;
+    }
+
+    uint32 slot[2];
+    memcpy(slot, buff + column->offset, sizeof(slot));
+    field->store((char*)buff + slot[0], slot[1], &my_charset_bin, CHECK_FIELD_WARN);
+  }
+
+  for (uint i = 0; i < plan->counts[SAMPLE_DICTIONARY]; i++)
+  {
+    column_t *column = &plan->columns[SAMPLE_DICTIONARY][i];
+    Field *field = table->field[column->field];
+
+    if (plan_is_null(buff, column->field))
+    {
+      field->set_null();
+      continue;
+    }
+
+    uint32 slot[2];
+    memcpy(slot, buff + column->offset, sizeof(slot));
+
+    if (slot[1] == SAMPLE_CODED)
+      field->store((char*)column->dict->values[slot[0]], column->dict->lengths[slot[0]], &my_charset_bin, CHECK_FIELD_WARN);
+    else
+      field->store((char*)buff + slot[0], slot[1], &my_charset_bin, CHECK_FIELD_WARN);
+  }
+
+  for (uint i = 0; i < plan->counts[SAMPLE_PACKED]; i++)
+  {
+    column_t *column = &plan->columns[SAMPLE_PACKED][i];
+    Field *field = table->field[column->field];
+
+    if (plan_is_null(buff, column->field))
+    {
+      field->set_null();
+      continue;
+    }
+
+    const uchar *image = buff + column->offset;
+    field->unpack(field->ptr, image, image + column->length);
+  }
+
+  dbug_tmp_restore_column_map(table->write_set, org_bitmap);
+  return 0;
+}
+
+// Hash a column's value; the same value hashes the same on any server.
+// NULL hashes like one more value, so NULL rows are kept or skipped
+// together at the rate rather than all kept.
+uint64 ha_sample::record_hash(uint col)
+{
+  Field *field = table->field[col];
+  uint64 h = SAMPLE_HASH_NULL;
+
+  my_bitmap_map *org_bitmap = dbug_tmp_use_all_columns(table, table->read_set);
+
+  if (!field->is_null())
+  {
+    if (field->result_type() == INT_RESULT)
+    {
+      h = rng_mix((uint64) field->val_int());
+    }
+    else
+    {
+      String *str = field->val_str(&sample_key, &sample_key);
+      h = hash_bytes((uchar*)str->ptr(), str->length());
+    }
+  }
+
+  dbug_tmp_restore_column_map(table->read_set, org_bitmap);
+
+  return h;
+}
+
+// Feed every SAMPLE_SKETCH column of the row, sampled or not
+void ha_sample::record_sketch()
+{
+  for (uint i = 0; i < sample_table->sketched; i++)
+  {
+    sketch_t *sketch = &sample_table->sketches[i];
+    Field *field = table->field[sketch->field];
+
+    my_bitmap_map *org_bitmap = dbug_tmp_use_all_columns(table, table->read_set);
+    bool is_null = field->is_null();
+    double x = !is_null && sketch->numeric ? field->val_real(): 0;
+    dbug_tmp_restore_column_map(table->read_set, org_bitmap);
+
+    if (is_null)
+      continue;
+
+    uint64 h = record_hash(sketch->field);
+
+    sample_atomic_add(&sketch->rows, 1);
+    sketch_distinct(sketch, h);
+
+    uint64 count = sketch_count(sketch, h);
+
+    if (sample_atomic_load(&sketch->tops) < SAMPLE_SKETCH_TOP
+      || count > sample_atomic_load(&sketch->floor))
+    {
+      org_bitmap = dbug_tmp_use_all_columns(table, table->read_set);
+      sketch_top(sketch, h, count, field->val_str(&sample_key, &sample_key));
+      dbug_tmp_restore_column_map(table->read_set, org_bitmap);
+    }
+
+    if (sketch->numeric)
+      sketch_value(sketch, x);
+  }
+}
+
+// Pick the row's stratum by hashing its SAMPLE_KEY column
+uint ha_sample::record_stratum()
+{
+  return record_hash(sample_table->key) % sample_table->strata;
+}
+
+// Evaluate the row's string columns without copying them and return the
+// exact size record_place() will write. Varchar, blob and char values are
+// left pointing into the record buffer; anything that has to be formatted
+// lands in the column's own String, which keeps its allocation. Values
+// found in, or added to, a column dictionary take no variable space.
+uint ha_sample::record_measure(uchar *buf)
+{
+  plan_t *plan = sample_table->plan;
+  uint strings = plan->counts[SAMPLE_STRING];
+  uint length = plan->fixed;
+
+  if (!sample_strings)
+  {
+    uint count = strings + plan->counts[SAMPLE_DICTIONARY];
+    sample_strings = new String[count + 1];
+    sample_values  = (SampleRow*) sample_alloc(sizeof(SampleRow) * (count + 1));
+    sample_codes   = (uint32*) sample_alloc(sizeof(uint32) * (plan->counts[SAMPLE_DICTIONARY] + 1));
+  }
+
+  // Strings first, then dictionary columns, in sample_values
+  for (uint type = SAMPLE_STRING, base = 0; type <= SAMPLE_DICTIONARY; base += plan->counts[type++])
+  {
+    for (uint i = 0; i < plan->counts[type]; i++)
+    {
+      column_t *column = &plan->columns[type][i];
+      Field *field = table->field[column->field];
+      SampleRow *value = &sample_values[base + i];
+
+      if (field->is_null())
+      {
+        value->buffer = NULL;
+        value->length = 0;
+        continue;
+      }
+
+      String *str = field->val_str(&sample_strings[base + i], &sample_strings[base + i]);
+      value->buffer = (uchar*) str->ptr();
+      value->length = str->length();
+
+      if (type == SAMPLE_DICTIONARY)
+      {
+        sample_codes[i] = dict_code(column->dict, value->buffer, value->length);
+        if (sample_codes[i] != SAMPLE_INLINE)
+          continue;
+      }
+      length += value->length;
+    }
+  }
+
+  return length;
+}
+
+// Write the row measured by record_measure() straight into its final
+// place; each string value is copied exactly once. SAMPLE_WEIGHT columns
+// get the rate the row was sampled at rather than the inserted value.
+void ha_sample::record_place(uchar *row, uint weight)
+{
+  plan_t *plan = sample_table->plan;
+  uint32 offset = plan->fixed;
+
+  memset(row, 0, plan->nulls);
+
+  for (uint i = 0; i < plan->counts[SAMPLE_INT64]; i++)
+  {
+    column_t *column = &plan->columns[SAMPLE_INT64][i];
+    Field *field = table->field[column->field];
+
+    if (!column->is_weight && field->is_null())
+    {
+      plan_set_null(row, column->field);
+      continue;
+    }
+
+    int64 n = column->is_weight ? (int64) weight: field->val_int();
+    memcpy(row + column->offset, &n, sizeof(int64));
+  }
+
+  for (uint i = 0; i < plan->counts[SAMPLE_STRING]; i++)
+  {
+    column_t *column = &plan->columns[SAMPLE_STRING][i];
+    SampleRow *value = &sample_values[i];
+
+    if (!value->buffer)
+    {
+      plan_set_null(row, column->field);
+      continue;
+    }
+
+    uint32 slot[2] = { offset, value->length };
+    memcpy(row + column->offset, slot, sizeof(slot));
+    memcpy(row + offset, value->buffer, value->length);
+    offset += value->length;
+  }
+
+  for (uint i = 0; i < plan->counts[SAMPLE_DICTIONARY]; i++)
+  {
+    column_t *column = &plan->columns[SAMPLE_DICTIONARY][i];
+    SampleRow *value = &sample_values[plan->counts[SAMPLE_STRING] + i];
+
+    if (!value->buffer)
+    {
+      plan_set_null(row, column->field);
+      continue;
+    }
+
+    if (sample_codes[i] != SAMPLE_INLINE)
+    {
+      uint32 slot[2] = { sample_codes[i], SAMPLE_CODED };
+      memcpy(row + column->offset, slot, sizeof(slot));
+      continue;
+    }
+
+    uint32 slot[2] = { offset, value->length };
+    memcpy(row + column->offset, slot, sizeof(slot));
+    memcpy(row + offset, value->buffer, value->length);
+    offset += value->length;
+  }
+
+  for (uint i = 0; i < plan->counts[SAMPLE_PACKED]; i++)
+  {
+    column_t *column = &plan->columns[SAMPLE_PACKED][i];
+    Field *field = table->field[column->field];
+
+    if (field->is_null())
+    {
+      plan_set_null(row, column->field);
+      continue;
+    }
+
+    field->pack(row + column->offset, field->ptr);
+  }
+}
+
+int ha_sample::write_row(uchar *buf)
+{
+  sample_debug("%s", __func__);
+
+  sample_seen++;
+
+  if (sample_table->sketched)
+    record_sketch();
+
+  uint weight;
+  int hash = sample_atomic_load(&sample_table->hash);
+
+  if (hash >= 0)
+  {
+    // SAMPLE_HASH decides by the row itself, the same on every server
+    weight = sample_table_rate(sample_table);
+    if (!rng_keep(record_hash(hash), weight))
+      return 0;
+
+    if (sample_atomic_load(&sample_table->target))
+    {
+      count_rows();
+      sample_table_tune(sample_table);
+    }
+  }
+  else
+  {
+    // Unsampled rows cost a decrement and an increment; the gap to the
+    // next sampled row is drawn once per sampled row
+    if (sample_skip)
+    {
+      sample_skip--;
+      return 0;
+    }
+
+    // This row was picked at the rate its gap was drawn at
+    weight = sample_weight;
+
+    // An adaptive rate needs to know what came in
+    if (sample_atomic_load(&sample_table->target))
+    {
+      count_rows();
+      sample_table_tune(sample_table);
+    }
+
+    sample_weight = sample_table_rate(sample_table);
+    sample_skip = rng_skip(&sample_rng, sample_weight);
+  }
+
+  sample_sampled++;
+
+  arena_t *arena = sample_table->rows;
+  reservoir_t *res = NULL;
+  uint64 memory_limit = sample_atomic_load(&sample_memory_limit);
+  uint64 n = 0;
+
+  // Column dictionaries come out of the table's memory first
+  uint64 dictionary = sample_atomic_load(&sample_table->plan->dictionary);
+  memory_limit -= MY_MIN(dictionary, memory_limit);
+
+  // Strata share the memory limit evenly
+  if (sample_table->reservoirs)
+  {
+    res = sample_table->reservoirs[sample_table->key >= 0 ? record_stratum(): 0];
+    memory_limit /= sample_table->strata;
+  }
+
+  // Decide before doing any serialization work: in reservoir mode most
+  // rows fail the prefilter, otherwise claim a slot under the limits
+  if (res)
+  {
+    n = sample_atomic_add(&res->seen, 1);
+    if (!reservoir_wants(res, n))
+    {
+      sample_table_count(&sample_table->rows_limited, &sample_rows_dropped_limit, 1);
+      return 0;
+    }
+  }
+  else
+  {
+    arena_expire(arena);
+
+    if (!arena_room(arena, sample_shard, sample_table_limit(sample_table), memory_limit))
+    {
+      sample_spill_wake(sample_table);
+      sample_table_count(&sample_table->rows_limited, &sample_rows_dropped_limit, 1);
+      return 0;
+    }
+  }
+
+  // Avoid asserts in val_str() for columns that are not going to be updated
+  my_bitmap_map *org_bitmap = dbug_tmp_use_all_columns(table, table->read_set);
+
+  uint length = record_measure(buf);
+  uint64 bytes = slab_row_width(length);
+  bool stored = FALSE, lost = FALSE;
+
+  if (res)
+  {
+    pthread_mutex_lock(&sample_table->mutex);
+    uchar *ptr = reservoir_place(res, n, length, memory_limit, &lost);
+    if (ptr)
+    {
+      record_place(ptr, weight);
+      stored = TRUE;
+    }
+    pthread_mutex_unlock(&sample_table->mutex);
+  }
+  else
+  {
+    uchar *ptr = arena_place(arena, &sample_owned, length);
 
-  return record_store(sample_row, buf);
+    // Claimed on the owned slab's shard, inside the writing window so a
+    // drain's debit never comes first. The global gauges catch up a
+    // batch at a time as the slab is settled.
+    sample_shard = sample_owned->shard;
+    sample_atomic_add(&arena->shards[sample_shard].rows, 1);
+    sample_atomic_add(&arena->shards[sample_shard].bytes, bytes);
+
+    record_place(ptr, weight);
+    arena_place_end(sample_owned, length);
+
+    stored = TRUE;
+  }
+
+  dbug_tmp_restore_column_map(table->read_set, org_bitmap);
+
+  if (stored)
+    sample_inserted++;
+  else
+  if (lost)
+    sample_table_count(&sample_table->rows_contended, &sample_rows_dropped_contention, 1);
+  else
+    sample_table_count(&sample_table->rows_limited, &sample_rows_dropped_limit, 1);
+
+  return 0;
+}
+
+int ha_sample::update_row(const uchar *old_data, uchar *new_data)
+{
+  return HA_ERR_WRONG_COMMAND;
+}
+
+int ha_sample::delete_row(const uchar *buf)
+{
+  return HA_ERR_WRONG_COMMAND;
+}
+
+int ha_sample::rnd_init(bool scan)
+{
+  sample_debug("%s", __func__);
+  rnd_end();
+  return 0;
+}
+
+int ha_sample::rnd_end()
+{
+  sample_debug("%s", __func__);
+
+  // Whole slabs go back to the table at once, not row by row, and not
+  // on this thread
+  if (sample_cursor)
+  {
+    sample_table_leave(sample_table, sample_cursor);
+
+    use_trash();
+    list_insert_head(sample_trash, sample_cursor);
+    sample_cursor = NULL;
+  }
+
+  return 0;
+}
+
+int ha_sample::rnd_next(uchar *buf)
+{
+  sample_debug("%s", __func__);
+
+  if (!sample_cursor)
+  {
+    sample_cursor = THDVAR(ha_thd(), consume)
+      ? sample_table_scan(sample_table)
+      : sample_table_snapshot(sample_table);
+  }
+
+  if (!cursor_next(sample_cursor, &sample_row))
+    return record_store(NULL, buf);
+
+  return record_store(&sample_row, buf);
 }
 
 int ha_sample::index_init(uint idx, bool sorted)
@@ -719,26 +3519,131 @@ void ha_sample::position(const uchar *record)
 {
 }
 
+// Discard everything stored. With sample_consume=0 this is the only way
+// rows leave the table.
+int ha_sample::delete_all_rows()
+{
+  sample_debug("%s", __func__);
+  use_trash();
+  list_insert_head(sample_trash, sample_table_drain(sample_table));
+  return 0;
+}
+
+// Unlike a SELECT, TRUNCATE also starts the sketches and the column
+// dictionaries over. It holds the table exclusively, so once the rows
+// are gone only the flusher could still look codes up; that is kept out,
+// and made to rewrite the .sample file after.
+int ha_sample::truncate()
+{
+  sample_debug("%s", __func__);
+
+  for (uint i = 0; i < sample_table->sketched; i++)
+    sketch_reset(&sample_table->sketches[i]);
+
+  int error = delete_all_rows();
+
+  plan_t *plan = sample_table->plan;
+
+  pthread_mutex_lock(&sample_table->flush_mutex);
+
+  for (uint i = 0; i < plan->counts[SAMPLE_DICTIONARY]; i++)
+    dict_reset(plan->columns[SAMPLE_DICTIONARY][i].dict);
+
+  sample_atomic_add(&sample_table->drains, 1);
+
+  pthread_mutex_unlock(&sample_table->flush_mutex);
+
+  return error;
+}
+
 int ha_sample::rnd_pos(uchar *buf, uchar *pos)
 {
   return HA_ERR_WRONG_COMMAND;
 }
 
+// Counts a handler keeps to itself between statements, added to the
+// table's and the global ones in one go
+void ha_sample::count_flush()
+{
+  if (sample_owned)
+    arena_settle(sample_owned);
+
+  count_rows();
+}
+
+// Just the row counters, without settling the owned slab
+void ha_sample::count_rows()
+{
+  if (sample_seen)
+  {
+    sample_atomic_add(&sample_table->seen, sample_seen);
+    sample_table_count(&sample_table->rows_seen, &sample_rows_seen, sample_seen);
+    sample_seen = 0;
+  }
+
+  if (sample_sampled)
+  {
+    sample_table_count(&sample_table->rows_sampled, &sample_rows_sampled, sample_sampled);
+    sample_sampled = 0;
+  }
+
+  if (sample_inserted)
+  {
+    sample_table_count(&sample_table->rows_inserted, &sample_counter_rows_inserted, sample_inserted);
+    sample_inserted = 0;
+  }
+}
+
 int ha_sample::info(uint flag)
 {
   sample_debug("%s", __func__);
+
+  if (flag & HA_STATUS_VARIABLE)
+  {
+    count_flush();
+
+    uint64 rows, bytes;
+    sample_table_usage(sample_table, &rows, &bytes);
+
+    stats.records = rows;
+    stats.data_file_length = bytes;
+    stats.mean_rec_length = rows ? (ulong) (bytes / rows): 0;
+  }
   return 0;
 }
 
 int ha_sample::reset()
 {
   sample_debug("%s", __func__);
+  empty_trash();
   return 0;
 }
 
 int ha_sample::external_lock(THD *thd, int lock_type)
 {
   sample_debug("%s", __func__);
+
+  // End of statement; counts are exact at statement boundaries, and
+  // drained rows go off to be freed
+  if (lock_type == F_UNLCK && sample_table)
+  {
+    count_flush();
+    empty_trash();
+  }
+
+  // Start of statement; a gap drawn at a rate since changed by SET GLOBAL
+  // or ALTER would hold the old rate until its next sampled row
+  if (lock_type != F_UNLCK && sample_table)
+  {
+    uint rate = sample_table_rate(sample_table);
+
+    if (rate != sample_weight)
+    {
+      sample_weight = rate;
+      sample_skip = rng_skip(&sample_rng, sample_weight);
+    }
+  }
+
   return 0;
 }
 
@@ -746,24 +3651,33 @@ int ha_sample::delete_table(const char *name)
 {
   sample_debug("%s %s", __func__, name);
 
-  pthread_mutex_lock(&sample_tables_mutex);
+  pthread_rwlock_wrlock(&sample_tables_lock);
 
-  SampleTable *table = sample_table_open(name, 0, 0, 0);
+  // Unfile it straight away; nothing else can find it from here on
+  SampleTable *table = sample_table_find(name);
 
   if (table && !table->dropping)
   {
-    table->users++;
+    sample_atomic_add(&table->users, 1);
     table->dropping = TRUE;
-    while (table->users > 1)
-    {
-      pthread_mutex_unlock(&sample_tables_mutex);
-      usleep(1000);
-      pthread_mutex_lock(&sample_tables_mutex);
-    }
-    sample_table_drop(table, TRUE);
+    hash_delete(sample_tables, table);
+  }
+  else
+  {
+    table = NULL;
   }
 
-  pthread_mutex_unlock(&sample_tables_mutex);
+  pthread_rwlock_unlock(&sample_tables_lock);
+
+  if (table)
+  {
+    sample_table_wait(table);
+    sample_table_drop(table, TRUE);
+  }
+  else
+  {
+    sample_file_remove(name);
+  }
 
   return 0;
 }
@@ -772,44 +3686,106 @@ int ha_sample::rename_table(const char *from, const char *to)
 {
   sample_debug("%s %s %s", __func__, from, to);
 
-  pthread_mutex_lock(&sample_tables_mutex);
+  pthread_rwlock_rdlock(&sample_tables_lock);
+
+  SampleTable *table = sample_table_find(from);
 
-  SampleTable *table = sample_table_open(from, 0, 0, 0);
+  if (table && sample_table != table)
+    sample_atomic_add(&table->users, 1);
+
+  pthread_rwlock_unlock(&sample_tables_lock);
 
   if (table)
   {
-    if (sample_table != table)
-      table->users++;
+    sample_table_wait(table);
 
-    while (table->users > 1)
-    {
-      pthread_mutex_unlock(&sample_tables_mutex);
-      usleep(1000);
-      pthread_mutex_lock(&sample_tables_mutex);
-    }
+    // The key changes, so re-file it
+    pthread_rwlock_wrlock(&sample_tables_lock);
+    pthread_mutex_lock(&table->flush_mutex);
+
+    hash_delete(sample_tables, table);
 
     sample_free(table->name);
     table->name = (char*) sample_alloc(strlen(to)+1);
     strcpy(table->name, to);
 
+    hash_insert(sample_tables, table);
+
+    sample_file_rename(from, to);
+
+    pthread_mutex_unlock(&table->flush_mutex);
+    pthread_rwlock_unlock(&sample_tables_lock);
+
     if (sample_table != table)
-      table->users--;
+      sample_table_close(table);
+  }
+  else
+  {
+    sample_file_rename(from, to);
   }
-
-  pthread_mutex_unlock(&sample_tables_mutex);
   return 0;
 }
 
 int ha_sample::create(const char *name, TABLE *table_arg, HA_CREATE_INFO *create_info)
 {
   sample_debug("%s %s", __func__, name);
+
+  ha_table_option_struct *options = table_arg->s->option_struct;
+
+  if (options->key && plan_field(table_arg->s, options->key) < 0)
+  {
+    sample_error("SAMPLE_KEY %s is not a column", options->key);
+    return HA_WRONG_CREATE_OPTION;
+  }
+
+  if (options->hash && plan_field(table_arg->s, options->hash) < 0)
+  {
+    sample_error("SAMPLE_HASH %s is not a column", options->hash);
+    return HA_WRONG_CREATE_OPTION;
+  }
   return 0;
 }
 
+// Only the options sample_table_options() re-reads on open can change in
+// place; anything else means rebuilding the table
 bool ha_sample::check_if_incompatible_data(HA_CREATE_INFO *info, uint table_changes)
 {
   sample_debug("%s", __func__);
-  return COMPATIBLE_DATA_NO;
+
+  ha_table_option_struct *param = info->option_struct;
+  ha_table_option_struct *options = table->s->option_struct;
+
+  bool same_key = param->key && options->key
+    ? !my_strcasecmp(system_charset_info, param->key, options->key)
+    : param->key == options->key;
+
+  if (table_changes != IS_EQUAL_YES
+    || (info->used_fields & HA_CREATE_USED_ENGINE)
+    || param->mode != options->mode
+    || param->window != options->window
+    || param->quota != options->quota
+    || param->durable != options->durable
+    || param->spill != options->spill
+    || !same_key)
+    return COMPATIBLE_DATA_NO;
+
+  // SAMPLE_HASH may change in place, but only to a column; a rebuild goes
+  // through create(), which rejects the name
+  if (param->hash && plan_field(table->s, param->hash) < 0)
+    return COMPATIBLE_DATA_NO;
+
+  // The row plan and the sketches are built once, when the table is
+  // first opened
+  for (uint i = 0; i < table->s->fields; i++)
+  {
+    ha_field_option_struct *before = table->s->field[i]->option_struct;
+    ha_field_option_struct *after = info->fields_option_struct[i];
+
+    if (before->weight != after->weight || before->sketch != after->sketch)
+      return COMPATIBLE_DATA_NO;
+  }
+
+  return COMPATIBLE_DATA_YES;
 }
 
 THR_LOCK_DATA **ha_sample::store_lock(THD *thd, THR_LOCK_DATA **to, enum thr_lock_type lock_type)
@@ -854,15 +3830,19 @@ static void sample_verbose_update(THD * thd, struct st_mysql_sys_var *sys_var, v
 static void sample_rate_update(THD * thd, struct st_mysql_sys_var *sys_var, void *var, const void *save)
 {
   uint n = *((uint*)save);
-  *((uint*)var) = n;
-  sample_rate = n;
+  sample_atomic_store((uint*)var, n);
 }
 
 static void sample_limit_update(THD * thd, struct st_mysql_sys_var *sys_var, void *var, const void *save)
 {
   uint n = *((uint*)save);
-  *((uint*)var) = n;
-  sample_limit = n;
+  sample_atomic_store((uint*)var, n);
+}
+
+static void sample_memory_limit_update(THD * thd, struct st_mysql_sys_var *sys_var, void *var, const void *save)
+{
+  ulonglong n = *((ulonglong*)save);
+  sample_atomic_store((ulonglong*)var, n);
 }
 
 static MYSQL_SYSVAR_UINT(verbose, sample_verbose, 0,
@@ -874,22 +3854,159 @@ static MYSQL_SYSVAR_UINT(rate, sample_rate, 0,
 static MYSQL_SYSVAR_UINT(limit, sample_limit, 0,
   "Table rows limit.", 0, sample_limit_update, 10000, 1, UINT_MAX, 1);
 
+static MYSQL_SYSVAR_ULONGLONG(memory_limit, sample_memory_limit, 0,
+  "Table memory limit in bytes of stored rows.", 0, sample_memory_limit_update, 64*1024*1024, 1024, ULONGLONG_MAX, 1024);
+
 static struct st_mysql_sys_var *sample_system_variables[] = {
     MYSQL_SYSVAR(verbose),
     MYSQL_SYSVAR(rate),
     MYSQL_SYSVAR(limit),
+    MYSQL_SYSVAR(memory_limit),
+    MYSQL_SYSVAR(consume),
     NULL
 };
 
 static struct st_mysql_show_var func_status[]=
 {
   { "sample_counter_rows_inserted", (char*)&sample_counter_rows_inserted, SHOW_ULONGLONG },
+  { "sample_memory_used", (char*)&sample_memory_used, SHOW_ULONGLONG },
+  { "sample_rows_stored", (char*)&sample_rows_stored, SHOW_ULONGLONG },
+  { "sample_compressed_bytes", (char*)&sample_compressed_bytes, SHOW_ULONGLONG },
+  { "sample_uncompressed_bytes", (char*)&sample_uncompressed_bytes, SHOW_ULONGLONG },
+  { "sample_rows_expired", (char*)&sample_rows_expired, SHOW_ULONGLONG },
+  { "sample_rows_seen", (char*)&sample_rows_seen, SHOW_ULONGLONG },
+  { "sample_rows_sampled", (char*)&sample_rows_sampled, SHOW_ULONGLONG },
+  { "sample_rows_dropped_limit", (char*)&sample_rows_dropped_limit, SHOW_ULONGLONG },
+  { "sample_rows_dropped_contention", (char*)&sample_rows_dropped_contention, SHOW_ULONGLONG },
+  { "sample_file_bytes_written", (char*)&sample_file_bytes_written, SHOW_ULONGLONG },
+  { "sample_rows_spilled", (char*)&sample_rows_spilled, SHOW_ULONGLONG },
+  { "sample_spill_bytes", (char*)&sample_spill_bytes, SHOW_ULONGLONG },
   { 0,0,SHOW_UNDEF }
 };
 
 struct st_mysql_daemon unusable_sample=
 { MYSQL_DAEMON_INTERFACE_VERSION };
 
+static ST_FIELD_INFO sample_sketches_fields[] =
+{
+  { "TABLE_SCHEMA", NAME_CHAR_LEN, MYSQL_TYPE_STRING, 0, 0, 0, SKIP_OPEN_TABLE },
+  { "TABLE_NAME", NAME_CHAR_LEN, MYSQL_TYPE_STRING, 0, 0, 0, SKIP_OPEN_TABLE },
+  { "COLUMN_NAME", NAME_CHAR_LEN, MYSQL_TYPE_STRING, 0, 0, 0, SKIP_OPEN_TABLE },
+  { "STATISTIC", 16, MYSQL_TYPE_STRING, 0, 0, 0, SKIP_OPEN_TABLE },
+  { "VALUE", 255, MYSQL_TYPE_STRING, 0, MY_I_S_MAYBE_NULL, 0, SKIP_OPEN_TABLE },
+  { "ESTIMATE", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_DOUBLE, 0, 0, 0, SKIP_OPEN_TABLE },
+  { 0, 0, MYSQL_TYPE_NULL, 0, 0, 0, 0 }
+};
+
+static bool sample_sketches_row(THD *thd, TABLE *table, const char *schema, const char *name,
+  sketch_t *sketch, const char *statistic, const char *value, uint length, double estimate)
+{
+  table->field[0]->store(schema, strlen(schema), system_charset_info);
+  table->field[1]->store(name, strlen(name), system_charset_info);
+  table->field[2]->store(sketch->name, strlen(sketch->name), system_charset_info);
+  table->field[3]->store(statistic, strlen(statistic), system_charset_info);
+
+  if (value)
+  {
+    table->field[4]->set_notnull();
+    table->field[4]->store(value, length, system_charset_info);
+  }
+  else
+  {
+    table->field[4]->set_null();
+  }
+
+  table->field[5]->store(estimate);
+
+  return schema_table_store_record(thd, table);
+}
+
+// INFORMATION_SCHEMA.SAMPLE_SKETCHES: for each SAMPLE_SKETCH column, the
+// rows seen, distinct values, heavy hitters and, if numeric, quantiles
+static int sample_sketches_fill(THD *thd, TABLE_LIST *tables, COND *cond)
+{
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  static const char *quantile_names[] = { "0.5", "0.9", "0.99", "0.999" };
+
+  TABLE *out = tables->table;
+  bool failed = FALSE;
+
+  pthread_rwlock_rdlock(&sample_tables_lock);
+
+  for (uint64 b = 0; !failed && b < sample_tables->width; b++)
+  {
+    for (node_t *node = sample_tables->buckets[b]; !failed && node; node = node->next)
+    {
+      SampleTable *table = (SampleTable*) node->payload;
+
+      if (sample_atomic_load(&table->loading))
+        continue;
+
+      // ./schema/table
+      char path[FN_REFLEN];
+      snprintf(path, sizeof(path), "%s", table->name);
+
+      char *name = strrchr(path, '/');
+      if (!name)
+        continue;
+      *name++ = 0;
+
+      char *schema = strrchr(path, '/');
+      schema = schema ? schema+1: path;
+
+      for (uint i = 0; !failed && i < table->sketched; i++)
+      {
+        sketch_t *sketch = &table->sketches[i];
+
+        failed = sample_sketches_row(thd, out, schema, name, sketch, "rows", NULL, 0,
+            sample_atomic_load(&sketch->rows))
+          || sample_sketches_row(thd, out, schema, name, sketch, "distinct", NULL, 0,
+            sketch_distinct_estimate(sketch));
+
+        pthread_mutex_lock(&sketch->mutex);
+        for (uint j = 0; !failed && j < sketch->tops; j++)
+        {
+          top_t *top = &sketch->top[j];
+          failed = sample_sketches_row(thd, out, schema, name, sketch, "top",
+            top->value->buffer, top->value->length, top->count);
+        }
+        pthread_mutex_unlock(&sketch->mutex);
+
+        uint64 total = sketch->numeric ? sketch_values(sketch): 0;
+
+        for (uint j = 0; !failed && total && j < sizeof(quantiles)/sizeof(double); j++)
+        {
+          failed = sample_sketches_row(thd, out, schema, name, sketch, "quantile",
+            quantile_names[j], strlen(quantile_names[j]), sketch_quantile(sketch, quantiles[j], total));
+        }
+
+        if (!failed && total)
+        {
+          failed = sample_sketches_row(thd, out, schema, name, sketch, "min", NULL, 0,
+              sketch_double(sample_atomic_load(&sketch->min)))
+            || sample_sketches_row(thd, out, schema, name, sketch, "max", NULL, 0,
+              sketch_double(sample_atomic_load(&sketch->max)));
+        }
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&sample_tables_lock);
+
+  return failed ? 1: 0;
+}
+
+static int sample_sketches_init(void *p)
+{
+  ST_SCHEMA_TABLE *schema = (ST_SCHEMA_TABLE*) p;
+  schema->fields_info = sample_sketches_fields;
+  schema->fill_table  = sample_sketches_fill;
+  return 0;
+}
+
+static struct st_mysql_information_schema sample_sketches =
+{ MYSQL_INFORMATION_SCHEMA_INTERFACE_VERSION };
+
 mysql_declare_plugin(sample)
 {
   MYSQL_STORAGE_ENGINE_PLUGIN,
@@ -905,6 +4022,21 @@ mysql_declare_plugin(sample)
   sample_system_variables,                        /* system variables */
   NULL,                                         /* config options */
   0,                                            /* flags */
+},
+{
+  MYSQL_INFORMATION_SCHEMA_PLUGIN,
+  &sample_sketches,
+  "SAMPLE_SKETCHES",
+  "Sean Pringle, Wikimedia Foundation",
+  "Approximate statistics of SAMPLE_SKETCH columns",
+  PLUGIN_LICENSE_GPL,
+  sample_sketches_init,                           /* Plugin Init */
+  NULL,                                         /* Plugin Deinit */
+  0x0001 /* 0.1 */,
+  NULL,                                         /* status variables */
+  NULL,                                         /* system variables */
+  NULL,                                         /* config options */
+  0,                                            /* flags */
 }
 mysql_declare_plugin_end;
 maria_declare_plugin(sample)
@@ -937,5 +4069,20 @@ maria_declare_plugin(sample)
   NULL,                                         /* system variables */
   "1.00",                                       /* version, as a string */
   MariaDB_PLUGIN_MATURITY_EXPERIMENTAL          /* maturity */
+},
+{
+  MYSQL_INFORMATION_SCHEMA_PLUGIN,
+  &sample_sketches,
+  "SAMPLE_SKETCHES",
+  "Sean Pringle, Wikimedia Foundation",
+  "Approximate statistics of SAMPLE_SKETCH columns",
+  PLUGIN_LICENSE_GPL,
+  sample_sketches_init,                           /* Plugin Init */
+  NULL,                                         /* Plugin Deinit */
+  0x0001,                                       /* version number (0.1) */
+  NULL,                                         /* status variables */
+  NULL,                                         /* system variables */
+  "0.1",                                        /* string version */
+  MariaDB_PLUGIN_MATURITY_EXPERIMENTAL          /* maturity */
 }
 maria_declare_plugin_end;
@@ -24,9 +24,11 @@
 #include <sql_class.h>
 #include <probes_mysql.h>
 #include "thr_lock.h" /* THR_LOCK, THR_LOCK_DATA */
+#include "sample_rand.h"
 
 typedef bool (*map_fn)(void*, void*);
 typedef int (*cmp_fn)(void*, void*);
+typedef const char* (*key_fn)(void*);
 
 typedef struct str_st {
   char *buffer;
@@ -43,32 +45,246 @@ typedef struct list_st {
   uint64 length;
 } list_t;
 
+typedef struct hash_st {
+  node_t **buckets;
+  uint64 width;   // power of two
+  uint64 length;
+  key_fn key;
+} hash_t;
+
+typedef struct slab_st {
+  struct slab_st *next;
+  size_t length, limit;
+  size_t raw;     // when deflated, the length before
+  uint64 rows;
+  uint64 epoch;   // time bucket, in a windowed arena
+  uint64 id;      // unique in the arena, kept by a compressed copy
+  uint shard;     // counted against, in the arena
+  uint64 settled_rows;  // of rows, added to the global gauges
+  size_t settled_bytes; // and of length
+  int32 refs;
+  int32 writing;
+  int32 detached;
+  int32 plain;    // atomic, deflating did not shrink it
+  uchar *buffer;
+} slab_t;
+
+#define SAMPLE_SHARDS 16
+#define SAMPLE_CACHE_LINE 64
+#define SAMPLE_ALIGNED __attribute__((aligned(SAMPLE_CACHE_LINE)))
+
+// Counters the writers on one group of CPUs claim rows and bytes on,
+// each on a cache line of its own
+typedef struct SAMPLE_ALIGNED shard_st {
+  uint64 rows;    // atomic
+  uint64 bytes;   // atomic
+} shard_t;
+
+// Allocated cache line aligned; the fields written by many threads each
+// get a line of their own
+typedef struct arena_st {
+  slab_t *head SAMPLE_ALIGNED; // lock-free stack: CAS push, exchange drain
+  uint64 ids SAMPLE_ALIGNED;   // atomic, last slab id
+  shard_t shards[SAMPLE_SHARDS]; // rows and slab bytes claimed by writers, summed to read
+  bool compress SAMPLE_ALIGNED; // atomic, deflate slabs as they fill
+  uint64 window;  // seconds of rows kept, or 0
+  uint64 width;   // seconds per time bucket, or 0
+  uint64 expired; // atomic, buckets before this one are gone
+  pthread_mutex_t mutex; // guards spare, and relinking the stack
+  slab_t *spare;
+  uint spares;
+  void *base;     // as allocated, before aligning
+} arena_t;
+
+// A scan over slabs it holds a reference on, each read up to a fixed length
+typedef struct cursor_st {
+  struct cursor_st *shared; // drain this reads a share of, or NULL
+  slab_t **slabs;
+  size_t *lengths;
+  uint64 count;
+  uint64 index;
+  size_t offset;
+  uchar *scratch; // current slab inflated, when compressed
+  size_t limit;
+  uint64 inflated;
+  uchar *map;     // spill file, read once the slabs are done
+  uint64 mapped;
+  uint64 next;    // offset of the next record; atomic, when shared
+  uint64 run;     // offset of the next row in the current record
+  uint64 end;     // and the end of its rows
+  uint64 expired; // records from time buckets before this are skipped
+  uint64 claimed; // atomic, next slab for a reader, when shared
+  uint32 readers; // atomic, references, when shared
+  uint32 active;  // readers not yet finished, under SampleTable::mutex
+} cursor_t;
+
+#define SAMPLE_RESERVOIR_SLOTS 64
+#define SAMPLE_STRATA 65536
+
+typedef struct reservoir_st {
+  str_t **slots;
+  uint64 size;    // slots allocated so far
+  uint64 capacity;
+  uint64 filled;
+  uint64 bytes;
+  uint64 seen;    // atomic, rows offered since the last drain
+  uint64 next;    // atomic, index of the next row to accept once full
+  double w;
+  rng_t rng;
+} reservoir_t;
+
+enum {
+  SAMPLE_MODE_APPEND=0,
+  SAMPLE_MODE_RESERVOIR,
+};
+
+// How a column is stored
+enum {
+  SAMPLE_INT64=0,
+  SAMPLE_STRING,
+  SAMPLE_DICTIONARY, // string, coded when the value has been seen before
+  SAMPLE_PACKED,     // temporal and numeric, the Field::pack() image
+  SAMPLE_TYPES,
+};
+
+// Distinct values a column dictionary holds before new ones are stored inline
+#define SAMPLE_DICTIONARY_CODES 256
+#define SAMPLE_DICTIONARY_SLOTS 512 // power of two, twice the codes
+
+// Append-only per column value dictionary. Codes are only reused after
+// TRUNCATE, so rows in any slab can refer to them.
+typedef struct dict_st {
+  uchar *values[SAMPLE_DICTIONARY_CODES];
+  uint32 lengths[SAMPLE_DICTIONARY_CODES];
+  uint32 slots[SAMPLE_DICTIONARY_SLOTS]; // atomic, code+1 or empty
+  uint32 count;   // atomic
+  uint32 bytes;   // held by values, with their lengths
+  uint64 *total;  // atomic, plan_t::dictionary
+  pthread_mutex_t mutex; // serializes adding values
+} dict_t;
+
+#define SAMPLE_SKETCH_HLL_BITS 12   // 4096 registers, about 1.6% error
+#define SAMPLE_SKETCH_CMS_DEPTH 4
+#define SAMPLE_SKETCH_CMS_WIDTH 2048 // power of two
+#define SAMPLE_SKETCH_TOP 10
+#define SAMPLE_SKETCH_BUCKETS 4096  // log buckets each side of zero
+#define SAMPLE_SKETCH_OFFSET 1024   // of them below 1: about 1.6e-9 up to 2.6e26
+
+typedef struct top_st {
+  uint64 hash;
+  uint64 count;
+  str_t *value;
+} top_t;
+
+// Approximate statistics of one column over every row offered, sampled
+// or not. Everything but the heavy hitters is updated lock free.
+typedef struct sketch_st {
+  uint field;     // index into TABLE::field
+  char *name;
+  bool numeric;
+  uint64 rows;    // atomic, non-null values
+  uchar hll[1 << SAMPLE_SKETCH_HLL_BITS]; // atomic, HyperLogLog registers
+  uint32 cms[SAMPLE_SKETCH_CMS_DEPTH][SAMPLE_SKETCH_CMS_WIDTH]; // atomic, Count-Min
+  top_t top[SAMPLE_SKETCH_TOP]; // heavy hitters, under mutex
+  uint tops;      // atomic
+  uint64 floor;   // atomic, smallest heavy hitter count once full
+  uint32 pos[SAMPLE_SKETCH_BUCKETS]; // atomic, quantile buckets of x > 0
+  uint32 neg[SAMPLE_SKETCH_BUCKETS]; // atomic, and x < 0
+  uint64 zero;    // atomic
+  uint64 min;     // atomic, bits of the smallest double seen
+  uint64 max;     // atomic, and the largest
+  pthread_mutex_t mutex;
+} sketch_t;
+
+typedef struct column_st {
+  uint field;     // index into TABLE::field
+  uint offset;    // fixed slot in the row
+  bool is_unsigned;
+  bool is_weight; // SAMPLE_WEIGHT, stores the row's sample rate
+  uint length;    // packed image bytes
+  dict_t *dict;
+} column_t;
+
+// Per-table row layout, built once when the table is first opened
+typedef struct plan_st {
+  uint fields;
+  uint nulls;     // null bitmap bytes at the start of every row
+  uint fixed;     // bitmap, slots and wide packed images; variable length data follows
+  column_t *columns[SAMPLE_TYPES];
+  uint counts[SAMPLE_TYPES];
+  uint64 dictionary; // atomic, bytes held by the column dictionaries
+} plan_t;
+
+typedef struct flushed_st {
+  uint64 id;
+  size_t length;
+} flushed_t;
+
+// What of a SAMPLE_DURABLE table is already in its .sample file. Only
+// the flusher thread touches this.
+typedef struct flush_st {
+  flushed_t *slabs; // sorted by id
+  uint64 count;
+  uint32 *values; // per dictionary column, codes written
+  uint64 bytes;   // file size
+  uint64 drains;  // SampleTable::drains when last written
+  bool failed;    // last write failed; rewrite next time
+} flush_t;
+
+// Overflow of a SAMPLE_SPILL table: whole slabs moved to <name>.spill
+// once memory fills, and read back after the slabs by a SELECT
+typedef struct spill_st {
+  uint64 limit;   // bytes the file may grow to
+  uint64 bytes;   // atomic, file size
+  uint64 rows;    // atomic
+  int32 wanted;   // atomic, an INSERT hit a limit and woke the flusher
+} spill_t;
+
 typedef struct _SampleTable {
   char *name;
-  uint users;
-  uint width;
-  uint rate;
+  uint users;     // atomic, handlers holding a reference
+  plan_t *plan;
+  uint rate;      // atomic, SAMPLE_RATE or 0 for sample_rate
   bool dropping;
+  bool loading;   // atomic, filed but still being built
   pthread_mutex_t mutex;
-  uint limit;
-  list_t *rows;
+  pthread_cond_t users_cond; // signalled when users drops to one
+  uint limit;     // atomic, SAMPLE_LIMIT or 0 for sample_limit
+  uint target;    // atomic, SAMPLE_TARGET rows per second, or 0
+  uint adaptive;  // atomic, rate picked for the target, or 0 until known
+  uint64 seen;    // atomic, rows offered since period
+  uint64 period;  // atomic, time the rate was last picked
+  uint64 rows_seen;      // atomic, every row offered
+  uint64 rows_sampled;   // atomic, rows picked by the sample rate
+  uint64 rows_inserted;  // atomic, sampled rows stored
+  uint64 rows_limited;   // atomic, sampled rows over a limit or not kept by a reservoir
+  uint64 rows_contended; // atomic, sampled rows a reservoir lost to a concurrent insert
+  arena_t *rows;
+  reservoir_t **reservoirs; // one per stratum, or NULL in append mode
+  uint strata;
+  int key;        // SAMPLE_KEY field index, or -1
+  int hash;       // atomic, SAMPLE_HASH field index, or -1
+  sketch_t *sketches; // per SAMPLE_SKETCH column
+  uint sketched;
+  uint64 drains;  // atomic, SELECT and TRUNCATE drains
+  flush_t *flush; // SAMPLE_DURABLE, or NULL
+  spill_t *spill; // SAMPLE_SPILL, or NULL
+  cursor_t *scan; // consuming drain concurrent readers may join, unreferenced; under mutex
+  pthread_mutex_t flush_mutex; // held writing, taking or renaming the table's files
   THR_LOCK mysql_lock;
 } SampleTable;
 
+// Cursors a statement finished with, freed by the background thread
+typedef struct trash_st {
+  SampleTable *table; // pinned until then
+  list_t *cursors;
+} trash_t;
+
 typedef struct _SampleRow {
   uchar *buffer;
   uint length;
 } SampleRow;
 
-enum {
-  SAMPLE_NULL=1,
-  SAMPLE_INT08,
-  SAMPLE_INT32,
-  SAMPLE_INT64,
-  SAMPLE_STRING,
-  SAMPLE_TINYSTRING,
-};
-
 /** @brief
   Class definition for the storage engine
 */
@@ -76,14 +292,24 @@ class ha_sample: public handler
 {
   THR_LOCK_DATA lock;
   SampleTable *sample_table;
-  list_t *sample_trash;
+  list_t *sample_trash;    // cursors this statement finished with
 
-  list_t *sample_rows;
-  SampleRow *sample_row;
+  String *sample_strings;  // per string column, for values that need formatting
+  SampleRow *sample_values; // per string column, measured but not yet copied
+  uint32 *sample_codes;     // per dictionary column, code or SAMPLE_INLINE
+  slab_t *sample_owned;
 
-  uint counter_rows_inserted;
+  cursor_t *sample_cursor;
+  SampleRow sample_row;
 
-  struct drand48_data sample_rand;
+  rng_t sample_rng;
+  uint64 sample_skip;
+  String sample_key;   // SAMPLE_KEY or SAMPLE_HASH value, when it needs formatting
+  uint64 sample_seen;  // rows offered, not yet added to the table's count
+  uint64 sample_sampled;  // and rows sampled
+  uint64 sample_inserted; // and rows stored
+  uint sample_shard;   // arena shard of the slab this handler owns
+  uint sample_weight;  // rate the current gap was drawn at
 
 public:
   ha_sample(handlerton *hton, TABLE_SHARE *table_arg);
@@ -121,6 +347,8 @@ public:
   int write_row(uchar *buf);
   int update_row(const uchar *old_data, uchar *new_data);
   int delete_row(const uchar *buf);
+  int delete_all_rows();
+  int truncate();
   int rnd_init(bool scan);                                      //required
   int rnd_end();
   int rnd_next(uchar *buf);                                     ///< required
@@ -138,7 +366,13 @@ public:
   bool check_if_incompatible_data(HA_CREATE_INFO *info, uint table_changes);
   THR_LOCK_DATA **store_lock(THD *thd, THR_LOCK_DATA **to, enum thr_lock_type lock_type);     ///< required
   int record_store(SampleRow *row, uchar *buf);
-  SampleRow* record_place(uchar *buf);
+  uint64 record_hash(uint col);
+  uint record_stratum();
+  void record_sketch();
+  void count_flush();
+  void count_rows();
+  uint record_measure(uchar *buf);
+  void record_place(uchar *row, uint weight);
 
   void empty_trash();
   void use_trash();
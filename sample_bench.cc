@@ -0,0 +1,105 @@
+/* Copyright (c) 2014 Sean Pringle sean.pringle@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+/*
+  Per-INSERT cost of the sampling decision in ha_sample::write_row(),
+  standalone so it runs without a server tree:
+
+    g++ -O2 -o sample_bench sample_bench.cc && ./sample_bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sample_rand.h"
+
+#define ROWS 100000000ULL
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_drand48(unsigned rate, unsigned long long *sampled)
+{
+  struct drand48_data rand;
+  srand48_r(1, &rand);
+
+  unsigned long long n = 0;
+  double start = now();
+  for (unsigned long long i = 0; i < ROWS; i++)
+  {
+    long r; lrand48_r(&rand, &r);
+    if (r % rate == 0)
+      n++;
+  }
+  *sampled = n;
+  return (now() - start) * 1e9 / ROWS;
+}
+
+static double bench_skip(unsigned rate, unsigned long long *sampled)
+{
+  rng_t rng;
+  rng_seed(&rng, 1);
+
+  unsigned long long n = 0;
+  uint64_t skip = rng_skip(&rng, rate);
+  double start = now();
+  for (unsigned long long i = 0; i < ROWS; i++)
+  {
+    if (skip)
+    {
+      skip--;
+      continue;
+    }
+    skip = rng_skip(&rng, rate);
+    n++;
+  }
+  *sampled = n;
+  return (now() - start) * 1e9 / ROWS;
+}
+
+// SAMPLE_HASH on an integer request id: one mix and a compare per row
+static double bench_hash(unsigned rate, unsigned long long *sampled)
+{
+  unsigned long long n = 0;
+  double start = now();
+  for (unsigned long long i = 0; i < ROWS; i++)
+  {
+    if (rng_keep(i, rate))
+      n++;
+  }
+  *sampled = n;
+  return (now() - start) * 1e9 / ROWS;
+}
+
+int main()
+{
+  unsigned rates[] = { 1, 100, 10000 };
+
+  printf("%8s %16s %16s %16s %12s %12s %12s\n", "rate", "lrand48_r ns/row", "skip ns/row", "hash ns/row", "sampled", "sampled", "sampled");
+  for (unsigned i = 0; i < sizeof(rates)/sizeof(rates[0]); i++)
+  {
+    unsigned long long a, b, c;
+    double old_ns  = bench_drand48(rates[i], &a);
+    double new_ns  = bench_skip(rates[i], &b);
+    double hash_ns = bench_hash(rates[i], &c);
+    printf("%8u %16.2f %16.2f %16.2f %12llu %12llu %12llu\n", rates[i], old_ns, new_ns, hash_ns, a, b, c);
+  }
+  return 0;
+}
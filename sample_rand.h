@@ -0,0 +1,82 @@
+/* Copyright (c) 2014 Sean Pringle sean.pringle@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+/*
+  Sampling PRNG, kept free of server headers so sample_bench.cc can use it.
+
+  xorshift64* is plenty for choosing rows and costs a few cycles, against
+  the lock and division inside lrand48_r().
+*/
+
+#ifndef SAMPLE_RAND_INCLUDED
+#define SAMPLE_RAND_INCLUDED
+
+#include <stdint.h>
+#include <math.h>
+
+typedef struct rng_st {
+  uint64_t state;
+} rng_t;
+
+// splitmix64's finalizer: every input bit moves every output bit
+static inline uint64_t rng_mix(uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static inline void rng_seed(rng_t *rng, uint64_t seed)
+{
+  // splitmix64, so consecutive seeds give unrelated streams
+  uint64_t z = rng_mix(seed + 0x9E3779B97F4A7C15ULL);
+  rng->state = z ? z: 1;
+}
+
+static inline uint64_t rng_next(rng_t *rng)
+{
+  uint64_t x = rng->state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  rng->state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in (0,1], safe to take the log of
+static inline double rng_unit(rng_t *rng)
+{
+  return ((rng_next(rng) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// Rows to skip before the next one sampled at 1-in-rate: a geometric draw,
+// so a caller can count down instead of rolling the dice per row.
+static inline uint64_t rng_skip(rng_t *rng, uint64_t rate)
+{
+  if (rate <= 1)
+    return 0;
+  return (uint64_t) floor(log(rng_unit(rng)) / log1p(-1.0 / (double) rate));
+}
+
+// Keep a row at 1-in-rate by its key's hash rather than by chance, so
+// every server given the same key and rate makes the same choice. Offset
+// first, as rng_mix(0) is 0 and would pass at every rate.
+static inline int rng_keep(uint64_t hash, uint64_t rate)
+{
+  return rate <= 1 || rng_mix(hash + 0x9E3779B97F4A7C15ULL) <= UINT64_MAX / rate;
+}
+
+#endif